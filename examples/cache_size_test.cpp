@@ -57,6 +57,20 @@ int main(int argc, char ** argv) {
             std::cout << std::endl;
         }
 
+        // The planner predicts the same growth from the model's hyperparameters alone
+        SessionConfig config;
+        config.context_length = 4096;
+        MemoryEstimate estimate = LLMSession::estimate_memory(argv[1], config);
+        std::cout << "=== Memory Planner Estimate (n_ctx=4096) ===" << std::endl;
+        std::cout << "  KV per token:     " << estimate.kv_bytes_per_token << " bytes" << std::endl;
+        std::cout << "  KV cache:         " << (estimate.kv_bytes / 1024.0 / 1024.0) << " MB" << std::endl;
+        std::cout << "  Compute buffers:  " << (estimate.compute_bytes / 1024.0 / 1024.0) << " MB (upper bound)" << std::endl;
+        std::cout << "  Full snapshot:    " << (estimate.state_bytes / 1024.0 / 1024.0) << " MB" << std::endl;
+
+        SessionConfig planned = LLMSession::plan_config(argv[1], 1500, 500, size_t(512) << 20);
+        std::cout << "  Plan for 1500+500 tokens in 512 MB: n_ctx=" << planned.context_length
+                  << " n_batch=" << planned.n_batch << " n_ubatch=" << planned.n_ubatch << "\n" << std::endl;
+
         std::cout << "=== Key Findings ===" << std::endl;
         std::cout << "1. Cache size grows with prompt length (KV cache stores attention keys/values)" << std::endl;
         std::cout << "2. Load time increases with cache size (memory copy + state restoration)" << std::endl;
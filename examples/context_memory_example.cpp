@@ -1,6 +1,7 @@
 #include "constrained_llm.h"
 #include <iostream>
 #include <chrono>
+#include <memory>
 
 using namespace std::chrono;
 
@@ -99,6 +100,73 @@ Now extract data from the following:
         std::cout << "- Useful for A/B testing different continuations" << std::endl;
         std::cout << "- Perfect for implementing undo/redo" << std::endl;
 
+        std::cout << "\n=== Branching Without Copies ===" << std::endl;
+
+        // fork() shares the KV cache of the context instead of copying it
+        std::cout << "\n6. Forking the loaded session..." << std::endl;
+        std::unique_ptr<LLMSession> branch = llm2.fork();
+        std::string shared_output = llm2.get_output();
+        *branch += "\nInput: Carlos Ruiz, age 52, lives in Lima\nOutput: ";
+        std::string branch_output = branch->generate(20, {"\n"}, 0.0f);
+        std::cout << "Branch output: " << branch_output << std::endl;
+        if (branch->get_output().compare(0, shared_output.size(), shared_output) != 0 || llm2.get_output() != shared_output) {
+            std::cerr << "Fork changed the original session!" << std::endl;
+            return 1;
+        }
+        branch.reset();
+
+        // checkpoint() / rollback() truncate the KV cache in place
+        std::cout << "\n7. Checkpoint and rollback..." << std::endl;
+        SessionCheckpoint before_turn = llm2.checkpoint();
+        llm2 += "\nInput: Yuki Tanaka, age 24, lives in Osaka\nOutput: ";
+        std::cout << "Turn output: " << llm2.generate(20, {"\n"}, 0.0f) << std::endl;
+        if (!llm2.rollback(before_turn) || llm2.get_output() != shared_output) {
+            std::cerr << "Rollback did not restore the checkpoint!" << std::endl;
+            return 1;
+        }
+        std::cout << "Rolled back to " << llm2.get_output().size() << " characters" << std::endl;
+
+        // With context shift a small context keeps going past its length
+        std::cout << "\n8. Context shift in a 512 token context..." << std::endl;
+        LLMSession chat(argv[1], 512);
+        chat.enable_context_shift(true, 32);
+        chat += "You are a concise assistant.\n";
+        int discarded = 0;
+        for (int turn = 0; turn < 24; turn++) {
+            chat += "Input: Person " + std::to_string(turn) + ", age " + std::to_string(20 + turn) + ", lives in Rome\nOutput: ";
+            chat.generate(24, {"\n"}, 0.0f);
+            discarded += chat.get_last_stats().tokens_discarded;
+        }
+        std::cout << "Tokens discarded by context shift: " << discarded << std::endl;
+        if (discarded == 0 || chat.get_output().compare(0, 29, "You are a concise assistant.\n") != 0) {
+            std::cerr << "Context shift did not keep the sinks!" << std::endl;
+            return 1;
+        }
+
+        // Lazy prefill evaluates a turn's appends in one batch with the generate that follows
+        std::cout << "\n9. Lazy prefill..." << std::endl;
+        LLMSession eager(argv[1], 2048);
+        LLMSession lazy(argv[1], 2048);
+        lazy.enable_lazy_prefill();
+        for (LLMSession * session : {&eager, &lazy}) {
+            auto start = high_resolution_clock::now();
+            *session += long_prompt;
+            *session += "Input: Alice Brown, age 30, ";
+            *session += "lives in Boston\n";
+            *session += "Output: ";
+            std::string output = session->generate(20, {"\n"}, 0.0f);
+            auto ms = duration_cast<milliseconds>(high_resolution_clock::now() - start).count();
+            std::cout << (session == &lazy ? "Lazy:  " : "Eager: ") << output << " (" << ms << " ms)" << std::endl;
+        }
+        std::vector<uint8_t> lazy_state = lazy.save_context_to_memory();
+        LLMSession restored(argv[1], 2048);
+        if (eager.get_output().compare(0, long_prompt.size(), long_prompt) != 0 ||
+            lazy.get_output().compare(0, long_prompt.size(), long_prompt) != 0 ||
+            !restored.load_context_from_memory(lazy_state) || restored.get_output() != lazy.get_output()) {
+            std::cerr << "Lazy prefill lost buffered text!" << std::endl;
+            return 1;
+        }
+
     } catch (const std::exception & e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
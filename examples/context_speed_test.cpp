@@ -142,6 +142,35 @@ Now extract data from the following:
         std::string output2 = llm2.generate(30, {"\n"}, 0.3f);
         std::cout << "Output 2: " << output2 << std::endl;
 
+        // Test 5: Prompt-lookup speculation copies spans from the few-shot examples
+        std::cout << "\n=== Prompt Lookup Speculation ===" << std::endl;
+        std::string query = "Input: Anna Schmidt, age 36, lives in Vienna, works as Engineer\nOutput: ";
+        std::vector<uint8_t> prompt_state = llm3.save_context_to_memory();
+
+        GenerateOptions extract;
+        extract.max_tokens = 40;
+        extract.temperature = 0.0f;
+        extract.stop_sequences = {"\n"};
+
+        llm3 += query;
+        auto start_plain = high_resolution_clock::now();
+        std::string plain = llm3.generate(extract);
+        auto duration_plain = duration_cast<milliseconds>(high_resolution_clock::now() - start_plain);
+
+        llm3.load_context_from_memory(prompt_state);
+        llm3 += query;
+        extract.prompt_lookup = true;
+        auto start_lookup = high_resolution_clock::now();
+        std::string looked_up = llm3.generate(extract);
+        auto duration_lookup = duration_cast<milliseconds>(high_resolution_clock::now() - start_lookup);
+        GenerationStats stats = llm3.get_last_stats();
+
+        std::cout << "Without lookup: " << duration_plain.count() << " ms: " << plain << std::endl;
+        std::cout << "With lookup:    " << duration_lookup.count() << " ms: " << looked_up << std::endl;
+        std::cout << "Draft tokens accepted: " << stats.draft_accepted << "/" << stats.draft_proposed
+                  << " (" << stats.acceptance_rate() * 100 << "%)" << std::endl;
+        std::cout << (plain == looked_up ? "Outputs match" : "Outputs differ!") << std::endl;
+
         // Clean up
         std::remove(context_file);
 
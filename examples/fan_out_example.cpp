@@ -0,0 +1,99 @@
+#include "constrained_llm.h"
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "llama.h"
+
+using namespace std::chrono;
+
+// Extracts the fields of a short profile twice: one after another in a growing context, and
+// with fan_out(), which decodes all fields together from the shared document prefix.
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model-path>" << std::endl;
+        return 1;
+    }
+
+    // Disable llama.cpp logs with null callback
+    llama_log_set([](ggml_log_level level, const char * text, void * user_data) {
+        (void) level;
+        (void) text;
+        (void) user_data;
+    }, nullptr);
+
+    const std::string document =
+        "<doc>Maria Keller, 38, is a structural engineer from Zurich. She joined Alpine Bridges "
+        "in 2015, speaks German, French and English, and leads a team of twelve.</doc>\n";
+
+    struct field_spec {
+        const char * name;
+        const char * prompt;
+        PatternType pattern;
+        int max_tokens;
+    };
+    const field_spec specs[] = {
+        {"name", "Name: ", PATTERN_NONE, 12},
+        {"age", "Age: ", PATTERN_NUMERIC, 3},
+        {"city", "City: ", PATTERN_NONE, 8},
+        {"employer", "Employer: ", PATTERN_NONE, 10},
+        {"since", "Joined in: ", PATTERN_NUMERIC, 4},
+        {"languages", "Languages: ", PATTERN_NONE, 16},
+        {"team_size", "Team size: ", PATTERN_NONE, 6},
+    };
+
+    std::vector<FanOutField> fields;
+    for (const field_spec & spec : specs) {
+        FanOutField field;
+        field.name = spec.name;
+        field.prompt = spec.prompt;
+        field.generate.max_tokens = spec.max_tokens;
+        field.generate.temperature = 0.0f;
+        field.generate.pattern = spec.pattern;
+        field.generate.stop_sequences = {"\n"};
+        fields.push_back(field);
+    }
+    FanOutField role;
+    role.name = "role";
+    role.prompt = "Role: ";
+    role.options = {"engineer", "manager", "researcher", "other"};
+    fields.push_back(role);
+
+    try {
+        SessionConfig config;
+        config.context_length = 4096;
+        LLMSession llm(argv[1], config);
+
+        // Sequential: every field grows the same context
+        llm += document;
+        std::vector<uint8_t> prefix = llm.save_context_to_memory();
+        auto start = high_resolution_clock::now();
+        for (const FanOutField & field : fields) {
+            llm += field.prompt;
+            if (field.options.empty()) {
+                llm.generate(field.generate);
+            } else {
+                llm.select(field.options);
+            }
+            llm += "\n";
+        }
+        double sequential_ms = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+
+        // Fan-out: all fields from the document prefix at once
+        llm.load_context_from_memory(prefix);
+        start = high_resolution_clock::now();
+        std::map<std::string, std::string> record = llm.fan_out(fields);
+        double fan_out_ms = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+
+        std::cout << "=== Extracted Fields ===" << std::endl;
+        for (const FanOutField & field : fields) {
+            std::cout << field.name << ": " << record[field.name] << std::endl;
+        }
+        std::cout << "\nSequential: " << sequential_ms << " ms" << std::endl;
+        std::cout << "Fan-out:    " << fan_out_ms << " ms" << std::endl;
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -4,36 +4,54 @@
 #include <vector>
 #include "llama.h"
 
+// Constraint handles compiled once and reused by every agent iteration
+struct AgentConstraints {
+    CompiledOptions actions;
+    GenerateOptions think;
+    GenerateOptions addmemory;
+    GenerateOptions response;
+};
+
+static GenerateOptions tag_body(LLMSession & llm, int max_tokens, const std::string & close_tag) {
+    GenerateOptions options;
+    options.max_tokens = max_tokens;
+    options.temperature = 0.0f;
+    options.compiled_stops = llm.compile_stops({close_tag});
+    return options;
+}
+
 // Helper function to run an agent loop with memory
 std::string run_agent_loop(
     LLMSession & llm,
-    const std::vector<uint8_t> & cached_prompt,
+    const AgentConstraints & constraints,
+    const SessionCheckpoint & system_prompt,
     const std::string & question,
     std::vector<std::string> & memory_store,
     int max_iterations = 10
 ) {
-    llm.load_context_from_memory(cached_prompt);
+    // Drops the previous question from the KV cache; the system prompt is not re-evaluated
+    llm.rollback(system_prompt);
 
     llm += "<input>" + question + "</input>\n\n";
 
     std::string final_response;
 
     for (int i = 0; i < max_iterations; i++) {
-        std::string tag = llm.select({"<think>", "<addmemory>", "<response>"});
+        std::string tag = llm.select(constraints.actions);
 
         std::cout << "[Agent chose: " << tag << "]" << std::endl;
 
         if (tag == "<think>") {
-            std::string thinking = llm.generate(300, {"</think>"}, 0.0f);
+            std::string thinking = llm.generate(constraints.think);
             std::cout << "Thinking " << (i+1) << ": " << thinking << std::endl;
 
         } else if (tag == "<addmemory>") {
-            std::string memory_item = llm.generate(200, {"</addmemory>"}, 0.0f);
+            std::string memory_item = llm.generate(constraints.addmemory);
             std::cout << "Adding to memory: " << memory_item << std::endl;
             memory_store.push_back(memory_item);
 
         } else if (tag == "<response>") {
-            final_response = llm.generate(300, {"</response>"}, 0.0f);
+            final_response = llm.generate(constraints.response);
             std::cout << "Response: " << final_response << std::endl;
             break;
         }
@@ -42,7 +60,7 @@ std::string run_agent_loop(
     if (final_response.empty()) {
         std::cout << "[Max iterations reached - forcing response]" << std::endl;
         llm += "<response>";
-        final_response = llm.generate(300, {"</response>"}, 0.0f);
+        final_response = llm.generate(constraints.response);
         std::cout << "Response: " << final_response << std::endl;
     }
 
@@ -69,7 +87,6 @@ int main(int argc, char ** argv) {
         std::cout << "3. <response> - Provide final answer\n" << std::endl;
 
         LLMSession llm(argv[1], 8192);
-        llm.enable_auto_cache(true);
 
         llm += R"(You are an AI agent with the ability to store memories.
 
@@ -120,30 +137,36 @@ Follow this pattern. Store important user information in memory.
 
 )";
 
-        std::cout << "System prompt loaded and cached!" << std::endl;
-        std::vector<uint8_t> cached_prompt = llm.get_cached_prompt();
+        std::cout << "System prompt loaded!" << std::endl;
+        SessionCheckpoint system_prompt = llm.checkpoint();
+
+        AgentConstraints constraints;
+        constraints.actions = llm.compile_options({"<think>", "<addmemory>", "<response>"});
+        constraints.think = tag_body(llm, 300, "</think>");
+        constraints.addmemory = tag_body(llm, 200, "</addmemory>");
+        constraints.response = tag_body(llm, 300, "</response>");
 
         std::vector<std::string> memory_store;
 
         // Test 1: User introduces themselves
         std::cout << "\n=== Test 1: User Introduction ===" << std::endl;
         std::cout << "User: My name is Bob and I love hiking. What's my name?" << std::endl;
-        run_agent_loop(llm, cached_prompt, "My name is Bob and I love hiking. What's my name?", memory_store);
+        run_agent_loop(llm, constraints, system_prompt, "My name is Bob and I love hiking. What's my name?", memory_store);
 
         // Test 2: Math question (shouldn't add to memory)
         std::cout << "\n=== Test 2: Simple Question ===" << std::endl;
         std::cout << "User: What is 15 + 27?" << std::endl;
-        run_agent_loop(llm, cached_prompt, "What is 15 + 27?", memory_store);
+        run_agent_loop(llm, constraints, system_prompt, "What is 15 + 27?", memory_store);
 
         // Test 3: User shares preferences
         std::cout << "\n=== Test 3: User Preferences ===" << std::endl;
         std::cout << "User: I'm allergic to peanuts and prefer vegetarian food. What should I order at a restaurant?" << std::endl;
-        run_agent_loop(llm, cached_prompt, "I'm allergic to peanuts and prefer vegetarian food. What should I order at a restaurant?", memory_store);
+        run_agent_loop(llm, constraints, system_prompt, "I'm allergic to peanuts and prefer vegetarian food. What should I order at a restaurant?", memory_store);
 
         // Test 4: Complex reasoning with facts
         std::cout << "\n=== Test 4: Complex Reasoning ===" << std::endl;
         std::cout << "User: If I save $50 per week, how long until I have $1000?" << std::endl;
-        run_agent_loop(llm, cached_prompt, "If I save $50 per week, how long until I have $1000?", memory_store);
+        run_agent_loop(llm, constraints, system_prompt, "If I save $50 per week, how long until I have $1000?", memory_store);
 
         // Display memory store
         std::cout << "\n=== Memory Store Contents ===" << std::endl;
@@ -0,0 +1,66 @@
+#include "constrained_llm.h"
+#include "prompt_program.h"
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "llama.h"
+
+using namespace std::chrono;
+
+// A review classifier written as one template. The program is compiled once and run for
+// every review: literal text is already tokenized, and the text between two holes is
+// evaluated in a single batch together with the last tokens of the hole before it.
+static const char * PROGRAM =
+    "<review>{{review}}</review>\n"
+    "Sentiment: {{#select 'sentiment'}}positive{{or}}negative{{or}}mixed{{/select}}\n"
+    "Rating (1-5): {{gen 'rating' pattern=numeric max_tokens=1}}\n"
+    "Summary: {{gen 'summary' max_tokens=40 stop='\\n' temperature=0}}\n";
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model-path>" << std::endl;
+        return 1;
+    }
+
+    // Disable llama.cpp logs with null callback
+    llama_log_set([](ggml_log_level level, const char * text, void * user_data) {
+        (void) level;
+        (void) text;
+        (void) user_data;
+    }, nullptr);
+
+    const char * reviews[] = {
+        "Battery lasts two days and the screen is gorgeous. Worth every penny.",
+        "Stopped charging after a week and support never answered my emails.",
+        "Great camera, but it gets hot and the speaker is tinny.",
+    };
+
+    try {
+        SessionConfig config;
+        config.context_length = 2048;
+        LLMSession llm(argv[1], config);
+        llm += "Classify each product review.\n\n";
+        std::vector<uint8_t> header = llm.save_context_to_memory();
+
+        CompiledProgram program = llm.compile_program(PROGRAM);
+
+        for (const char * review : reviews) {
+            llm.load_context_from_memory(header);
+
+            auto start = high_resolution_clock::now();
+            std::map<std::string, std::string> values = llm.run(program, {{"review", review}});
+            double ms = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+
+            std::cout << "Review:    " << review << std::endl;
+            std::cout << "Sentiment: " << values["sentiment"] << std::endl;
+            std::cout << "Rating:    " << values["rating"] << std::endl;
+            std::cout << "Summary:   " << values["summary"] << std::endl;
+            std::cout << "(" << llm.get_last_stats().tokens_generated << " tokens, " << ms << " ms)\n" << std::endl;
+        }
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
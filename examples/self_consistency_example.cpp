@@ -0,0 +1,67 @@
+#include "constrained_llm.h"
+#include <iostream>
+#include <map>
+#include <chrono>
+
+using namespace std::chrono;
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model-path>" << std::endl;
+        return 1;
+    }
+
+    try {
+        LLMSession llm(argv[1], 4096);
+
+        std::cout << "=== Self-Consistency Voting with generate_n ===" << std::endl;
+        llm += "Q: A farmer has 17 sheep. All but 9 run away. How many are left?\n";
+        llm += "Think step by step, then give the number after 'Answer:'.\n<think>";
+
+        GenerateOptions opts;
+        opts.max_tokens = 120;
+        opts.temperature = 0.7f;
+        opts.stop_sequences = {"</think>"};
+
+        auto start = high_resolution_clock::now();
+        std::vector<std::string> samples = llm.generate_n(8, opts);
+        auto duration = duration_cast<milliseconds>(high_resolution_clock::now() - start);
+
+        std::map<std::string, int> votes;
+        for (size_t i = 0; i < samples.size(); i++) {
+            std::string answer;
+            size_t pos = samples[i].rfind("Answer:");
+            if (pos != std::string::npos) {
+                answer = samples[i].substr(pos + 7);
+                answer.erase(0, answer.find_first_not_of(" "));
+                answer = answer.substr(0, answer.find_first_of(" .\n"));
+            }
+            std::cout << "Sample " << (i + 1) << ": " << (answer.empty() ? "(no answer)" : answer) << std::endl;
+            if (!answer.empty()) {
+                votes[answer]++;
+            }
+        }
+
+        std::string best;
+        int best_votes = 0;
+        for (const auto & vote : votes) {
+            if (vote.second > best_votes) {
+                best = vote.first;
+                best_votes = vote.second;
+            }
+        }
+
+        std::cout << "\nMajority answer: " << best << " (" << best_votes << "/" << samples.size() << " votes)" << std::endl;
+        std::cout << "Time for " << samples.size() << " samples: " << duration.count() << " ms" << std::endl;
+
+        // The session context still ends at <think>, so the chosen reasoning can be appended
+        llm += samples[0] + "</think>";
+        std::cout << "\nContinuing from sample 1: " << llm.generate(20, {"\n"}, 0.0f) << std::endl;
+
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include "session_pool.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std::chrono;
+
+// Aggregate generation throughput of a SessionPool as the number of concurrent sessions
+// grows. All sessions are driven from the main thread with the async calls: each one
+// queues its prompt and a generation, and the scheduler decodes them in shared batches.
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model-path> [max-sessions] [tokens]" << std::endl;
+        return 1;
+    }
+    int max_sessions = argc > 2 ? std::atoi(argv[2]) : 16;
+    int max_tokens = argc > 3 ? std::atoi(argv[3]) : 128;
+
+    SessionConfig config;
+    config.context_length = 1024 * max_sessions;
+    ModelHandle model = ModelHandle::load(argv[1], config);
+
+    const char * topics[] = {"the sea", "a mountain village", "an old library", "a night train"};
+
+    std::cout << "=== SessionPool Benchmark ===" << std::endl;
+    std::cout << "sessions  tokens/s  tokens/batch" << std::endl;
+    for (int n = 1; n <= max_sessions; n *= 2) {
+        SessionPool pool(model, config, n);
+
+        std::vector<std::unique_ptr<PooledSession>> sessions;
+        std::vector<std::future<std::string>> replies;
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < n; i++) {
+            sessions.push_back(pool.open());
+            sessions[i]->append_async(std::string("Write a short story about ") + topics[i % 4] + ".\n\n");
+            GenerateOptions options;
+            options.max_tokens = max_tokens;
+            options.seed = i;
+            replies.push_back(sessions[i]->generate_async(options));
+        }
+        for (auto & reply : replies) {
+            reply.get();
+        }
+        double seconds = duration<double>(high_resolution_clock::now() - start).count();
+
+        int total = 0;
+        for (auto & session : sessions) {
+            total += session->get_last_stats().tokens_generated;
+        }
+        std::cout << std::setw(8) << n << "  " << std::setw(8) << std::fixed << std::setprecision(1)
+                  << total / seconds << "  " << std::setw(12) << pool.get_stats().tokens_per_batch() << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "constrained_llm.h"
+#include <iostream>
+#include <chrono>
+
+using namespace std::chrono;
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model-path>" << std::endl;
+        return 1;
+    }
+
+    try {
+        LLMSession llm(argv[1], 2048);
+
+        std::cout << "=== Example 1: Stream a thinking block ===" << std::endl;
+        llm += "Use <think> tags for reasoning.\n<input>Why is the sky blue?</input>\n<think>";
+
+        auto start = high_resolution_clock::now();
+        bool first = true;
+
+        GenerateOptions opts;
+        opts.max_tokens = 150;
+        opts.temperature = 0.0f;
+        opts.stop_sequences = {"</think>"};
+        opts.on_text = [&](const char * text, size_t length) {
+            if (first) {
+                auto ttft = duration_cast<milliseconds>(high_resolution_clock::now() - start);
+                std::cout << "[first text after " << ttft.count() << " ms] ";
+                first = false;
+            }
+            std::cout.write(text, length);
+            std::cout.flush();
+            return true;
+        };
+
+        std::string thinking = llm.generate(opts);
+        std::cout << std::endl << "Returned text matches stream: " << thinking.length() << " bytes" << std::endl << std::endl;
+
+        llm.clear();
+
+        std::cout << "=== Example 2: Abort from the callback ===" << std::endl;
+        llm += "Count from one to twenty: one, two,";
+
+        size_t streamed = 0;
+        opts = GenerateOptions();
+        opts.max_tokens = 100;
+        opts.temperature = 0.0f;
+        opts.on_text = [&](const char * text, size_t length) {
+            std::cout.write(text, length);
+            std::cout.flush();
+            streamed += length;
+            return streamed < 40;
+        };
+
+        llm.generate(opts);
+        std::cout << std::endl << "Stopped after " << streamed << " bytes" << std::endl;
+
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
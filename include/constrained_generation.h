@@ -5,12 +5,79 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <atomic>
+#include <chrono>
+
+enum stop_reason {
+    STOP_NONE = 0,      // completed normally
+    STOP_MAX_TOKENS,
+    STOP_EOG,
+    STOP_SEQUENCE,
+    STOP_CALLBACK,
+    STOP_CANCELLED,
+    STOP_DEADLINE,
+    STOP_ERROR,
+};
+
+// Score of a sampled token against the full logits row it was sampled from
+struct token_logprob {
+    llama_token token;
+    float logprob;          // log probability under the model, before any sampler
+    int rank;               // number of tokens the model preferred (0 = its top choice)
+    float removed_logmass;  // log of the probability the constraint samplers removed, -inf if none
+};
 
 struct generate_params {
     int max_tokens = 50;
     float temperature = 0.7f;
+    uint32_t seed = 0;
     std::vector<std::string> stop_sequences;
     llama_sampler * custom_sampler = nullptr;
+    // Prebuilt sampler chain owned by the caller (e.g. pooled and reset between calls).
+    // When set, custom_sampler and the stop sequence sampler are not added.
+    llama_sampler * sampler = nullptr;
+    // Decode runs of constraint-forced tokens in one batch instead of one llama_decode each
+    bool jump_forward = true;
+    // Queue each sampled token for decoding while a helper thread detokenizes, stop-checks
+    // and streams its text. Tokens whose text contains the last byte of a stop sequence are
+    // checked before they are decoded. false keeps all of it on the calling thread.
+    bool pipeline = true;
+    // Streaming callback receiving text deltas as they become final; return false to stop.
+    // Incomplete UTF-8 sequences and text that could still become a stop sequence are held back.
+    // With pipeline set it may be called from the helper thread, one call at a time; tokens
+    // sampled after it returned false are removed again.
+    std::function<bool(const char * text, size_t length)> on_text;
+    // Speculative decoding. The drafter proposes up to n_max tokens following `tokens` (the
+    // tokens generated so far by this call, the last one not yet decoded); smpl is the
+    // generation chain in its current state so proposals can respect the same constraints.
+    // All proposals are verified in one batched decode and rejected positions are removed
+    // from the KV cache. Sampling is unchanged: every emitted token is drawn from the target
+    // logits at its position, so greedy output is identical with or without a drafter.
+    std::function<void(const std::vector<llama_token> & tokens, const llama_sampler * smpl,
+                       int n_max, std::vector<llama_token> & draft)> drafter;
+    int n_draft = 8;
+    // Prompt-lookup speculation, used when no drafter is set: proposals are copied from what
+    // followed the most recent earlier occurrence of the last lookup_ngram_max (down to
+    // lookup_ngram_min) tokens in lookup_tokens plus the tokens generated so far.
+    const std::vector<llama_token> * lookup_tokens = nullptr;
+    int lookup_ngram_min = 2;
+    int lookup_ngram_max = 4;
+    // Checked before every decode; generation then ends with STOP_CANCELLED or STOP_DEADLINE.
+    // Tokens already sampled are still decoded, so the context matches the returned tokens.
+    const std::atomic<bool> * cancel = nullptr;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Fill generate_result::logprobs. Tokens forced by a constraint skip the forward pass and
+    // report logprob NAN and rank -1; set jump_forward = false to score them as well.
+    bool logprobs = false;
+    // Sequence the context continues from and the generated tokens are decoded into
+    llama_seq_id seq_id = 0;
+    // Called before each decode that adds n_tokens positions to seq_id, so the caller can free
+    // room in the context (LLMSession's context shift). Positions are read from the KV cache
+    // afterwards, so it may move the sequence's existing cells.
+    std::function<void(int n_tokens)> make_room;
+    // Leave the last sampled tokens out of the KV cache for the caller to decode with what it
+    // evaluates next (generate_result::n_pending), instead of a decode of their own
+    bool leave_pending = false;
 };
 
 struct generate_result {
@@ -19,6 +86,15 @@ struct generate_result {
     bool stopped_by_sequence = false;
     std::string stop_sequence;
     int tokens_generated = 0;
+    int tokens_forced = 0;
+    bool stopped_by_callback = false;
+    int draft_proposed = 0;
+    int draft_accepted = 0;
+    stop_reason reason = STOP_NONE;
+    // One entry per element of tokens when params.logprobs is set
+    std::vector<token_logprob> logprobs;
+    // With params.leave_pending: how many of the last kept tokens are not in the KV cache
+    int n_pending = 0;
 };
 
 generate_result generate(
@@ -27,6 +103,95 @@ generate_result generate(
     const generate_params & params = generate_params()
 );
 
+enum token_status {
+    TOKEN_KEPT,     // appended to the result, must be decoded
+    TOKEN_EMPTY,    // produced no text, dropped
+    TOKEN_END,      // end of generation, not decoded
+};
+
+// Handles a sampled token the way generate() does: an EOG token ends generation, any other
+// has its text appended to the result and the stop sequences checked. For callers that run
+// their own decode loop (SessionPool).
+token_status take_token(
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    generate_result & result,
+    llama_token token
+);
+
+// STOP_CANCELLED or STOP_DEADLINE if a call with these limits should end now, else STOP_NONE
+stop_reason check_interrupt(const std::atomic<bool> * cancel, std::chrono::steady_clock::time_point deadline);
+
+// If the sampler's constraints allow exactly one next token, advances the sampler
+// as if that token had been sampled and returns it without touching the logits.
+bool sample_forced_token(llama_sampler * smpl, llama_token * token);
+
+// llama_sampler_sample() that also fills *out when it is not null. The chain is applied member
+// by member to see what its constraint samplers (all before the first temp, dist or greedy)
+// removed; the log-sum-exp and rank use one vectorizable pass over the logits row.
+llama_token sample_token(llama_sampler * smpl, llama_context * ctx, int32_t idx, token_logprob * out);
+
+// Clones the constraint samplers of chain (with their current state) into a new chain
+// ending in a greedy sampler; temp, dist and greedy members are dropped.
+llama_sampler * clone_constraint_chain(const llama_sampler * chain);
+
+// Decodes tokens after the last position of seq_id in n_batch sized chunks (logits are
+// kept for the last token only) and clears the vector on success.
+bool decode_tokens(llama_context * ctx, std::vector<llama_token> & tokens, llama_seq_id seq_id = 0);
+
+// Samples seq_ids.size() continuations of src_seq in parallel. src_seq is copied into
+// each seq_id with llama_memory_seq_cp (the prompt KV is shared, not re-evaluated) and all
+// streams are decoded together, one batch per step. Stream i samples with a clone of the
+// chain whose dist sampler is seeded with params.seed + i. The last decode must have been
+// the final token of src_seq; the forked sequences are removed before returning.
+// on_text, drafter and logprobs are not used.
+std::vector<generate_result> generate_n(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids
+);
+
+// One branch of generate_fan_out(): prompt is decoded after src_seq's tokens, then the branch
+// samples with a clone of params.sampler (or a chain built from params) until max_tokens, a
+// stop sequence or EOG. With option_tokens set it also ends, with STOP_NONE, as soon as its
+// tokens equal one of them (a select).
+struct fan_out_branch {
+    std::vector<llama_token> prompt;
+    generate_params params;
+    const std::vector<std::vector<llama_token>> * option_tokens = nullptr;
+};
+
+// Runs independent branches from src_seq in parallel, branch i on seq_ids[i]. src_seq is
+// shared with llama_memory_seq_cp and the prompts and sampled tokens of all branches are
+// decoded together, one batch per step, so the call costs about as many decodes as its
+// longest branch. A branch without a prompt starts from the logits of src_seq's last token,
+// which must have been the last decode. The branch sequences are removed before returning.
+// on_text, drafter and logprobs are not used.
+std::vector<generate_result> generate_fan_out(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const std::vector<fan_out_branch> & branches,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids,
+    const std::atomic<bool> * cancel = nullptr,
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()
+);
+
+// Constrained beam search with seq_ids.size() beams, each on its own sequence and with its
+// own clone of the chain's constraint samplers; all live beams are decoded in one batch per
+// step. Beams are ranked by the log probability of their constrained distributions and the
+// hypothesis with the best mean token log probability is returned and decoded into src_seq.
+// temperature, on_text, speculation and logprobs are not used.
+generate_result generate_beam(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids
+);
+
 llama_sampler * select_sampler(
     const struct llama_vocab * vocab,
     const std::vector<std::string> & options,
@@ -2,37 +2,291 @@
 #define GUIDANCE_H
 
 #include "token_filter_sampler.h"
+#include "constrained_generation.h"
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <functional>
+#include <future>
+#include <exception>
+
+enum KVCacheType {
+    KV_CACHE_F16 = 0,
+    KV_CACHE_Q8_0,
+    KV_CACHE_Q4_0
+};
+
+enum FlashAttention {
+    FLASH_ATTN_AUTO = 0,
+    FLASH_ATTN_ENABLED,
+    FLASH_ATTN_DISABLED
+};
+
+enum NumaStrategy {
+    NUMA_DISABLED = 0,
+    NUMA_DISTRIBUTE,
+    NUMA_ISOLATE,
+    NUMA_NUMACTL,
+    NUMA_MIRROR
+};
+
+// Model and context settings for LLMSession. Zero means the llama.cpp default.
+struct SessionConfig {
+    int context_length = 2048;
+    int n_batch = 0;            // default: min(context_length, 2048)
+    int n_ubatch = 0;           // must not exceed n_batch
+    int n_threads = 0;
+    int n_threads_batch = 0;    // default: n_threads
+    FlashAttention flash_attn = FLASH_ATTN_AUTO;
+    bool use_mmap = true;
+    bool use_mlock = false;
+    // Applies to K and V; quantized V requires flash attention
+    KVCacheType kv_cache_type = KV_CACHE_F16;
+    // Process-wide; only the first session that sets it has an effect
+    NumaStrategy numa = NUMA_DISABLED;
+    bool quiet = true;
+
+    SessionConfig() {}
+
+    // Validates the config (throws std::runtime_error) and returns the context parameters
+    // it describes; n_seq_max and kv_unified are left to the caller
+    llama_context_params context_params() const;
+};
+
+// Memory of a session estimated from the model's hyperparameters. KV sizes are exact for
+// attention-only models; compute_bytes is an upper bound that depends on the backend.
+struct MemoryEstimate {
+    size_t weights_bytes = 0;       // shared by all sessions on the same ModelHandle
+    size_t kv_bytes_per_token = 0;
+    size_t kv_bytes = 0;            // the full KV cache, allocated when the session is created
+    size_t compute_bytes = 0;       // compute graph for one n_ubatch plus the logits buffer
+    size_t state_bytes = 0;         // save_context_to_memory() of a full context
+
+    size_t session_bytes() const { return kv_bytes + compute_bytes; }
+};
 
 struct GenerateOptions {
     int min_tokens = 0;
     int max_tokens = 50;
     float temperature = 0.7f;
+    uint32_t seed = 0;
     std::vector<std::string> stop_sequences;
     std::string var_name;
     PatternType pattern = PATTERN_NONE;
     std::string regex_pattern;
+    // Precompiled handles; when set they are used instead of stop_sequences / pattern. A handle
+    // compiled for another model's vocabulary makes the call throw std::runtime_error.
+    CompiledStops compiled_stops;
+    CompiledPattern compiled_pattern;
+    // Called with text deltas while generating, possibly from a helper thread but never
+    // concurrently; return false to stop early
+    std::function<bool(const char * text, size_t length)> on_text;
+    // Speculate by copying spans that followed earlier occurrences of the last few tokens
+    // in the context (no draft model needed). Output is unchanged; ignored with a draft model.
+    bool prompt_lookup = false;
+    // Beam search with this many beams (decoded together, one sequence each) instead of
+    // sampling. min_tokens is ignored and on_text receives the winning text once at the end.
+    int n_beams = 1;
 
     GenerateOptions() {}
 };
 
+// One field of LLMSession::fan_out(): a prompt continuing the shared context and the value
+// generated after it, or selected from options if they are set
+struct FanOutField {
+    std::string name;                   // variable the value is stored in
+    std::string prompt;                 // e.g. "\nName: "
+    GenerateOptions generate;           // min_tokens, on_text, prompt_lookup and n_beams are not used
+    std::vector<std::string> options;
+    CompiledOptions compiled_options;   // used instead of options when set
+
+    FanOutField() {}
+};
+
+struct GenerationStats {
+    int tokens_generated = 0;
+    int tokens_forced = 0;
+    int draft_proposed = 0;
+    int draft_accepted = 0;
+    // Why the call ended; STOP_CANCELLED / STOP_DEADLINE mark partial results
+    stop_reason reason = STOP_NONE;
+    // One entry per generated token of select / generate while enable_logprobs() is on
+    std::vector<token_logprob> logprobs;
+    // Tokens of the previous context set_prompt kept in the KV cache instead of evaluating
+    int tokens_reused = 0;
+    // Tokens dropped from the context by the context shift (enable_context_shift)
+    int tokens_discarded = 0;
+
+    float acceptance_rate() const {
+        return draft_proposed > 0 ? (float) draft_accepted / draft_proposed : 0.0f;
+    }
+};
+
+// Reported after each chunk of a prompt is evaluated
+struct PrefillProgress {
+    int tokens_done = 0;
+    int tokens_total = 0;
+    int chunk_tokens = 0;
+    double chunk_ms = 0.0;
+};
+
+// Counters of a model's tokenization cache since it was loaded
+struct TokenCacheStats {
+    long hits = 0;
+    long misses = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+
+    double hit_rate() const {
+        return hits + misses > 0 ? (double) hits / (hits + misses) : 0.0;
+    }
+};
+
+// Reference-counted llama_model. load() keeps a registry keyed by path and load settings
+// (use_mmap, use_mlock), so sessions created from the same file share one copy of the weights
+// instead of loading it again. The model is freed with the last handle or session holding it,
+// and the llama.cpp backend is initialized while any model is loaded.
+class ModelHandle {
+public:
+    struct Data;
+
+    ModelHandle() {}
+
+    // Thread-safe. Throws std::runtime_error if the model cannot be loaded.
+    static ModelHandle load(const std::string & model_path, const SessionConfig & config = SessionConfig());
+
+    bool empty() const { return !data; }
+    llama_model * get() const;
+    const std::string & path() const;
+    // Handles and sessions currently sharing the model
+    long use_count() const { return data.use_count(); }
+
+    // llama_tokenize(add_special, parse_special = false) through an LRU cache shared by all
+    // sessions on the model, which tokenize every appended fragment this way. A fragment is
+    // never merged with the text around it, so its tokens depend only on its bytes and on
+    // add_special (the BOS at the start of a context): these are the key, and a hit returns
+    // exactly what a fresh call would. Thread-safe.
+    std::vector<llama_token> tokenize(const std::string & text, bool add_special) const;
+    // Bytes the cached texts and tokens may take (default 1 MiB); 0 disables the cache.
+    // Fragments over an eighth of the limit are not cached.
+    void set_token_cache_limit(size_t max_bytes) const;
+    TokenCacheStats token_cache_stats() const;
+
+private:
+    explicit ModelHandle(const std::shared_ptr<Data> & data) : data(data) {}
+
+    std::shared_ptr<Data> data;
+};
+
+// Cancels session calls from another thread. Copies share the same flag.
+class CancelToken {
+public:
+    CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { flag->store(true); }
+    void reset() { flag->store(false); }
+    bool is_cancelled() const { return flag->load(); }
+    const std::atomic<bool> * get() const { return flag.get(); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+// Completion callback of the *_async calls: the call's result ("" for append_async), or the
+// exception it threw and an empty result
+typedef std::function<void(const std::string & result, std::exception_ptr error)> AsyncCallback;
+
+// A position in a session's history returned by checkpoint(). It holds no KV data: the
+// context tokens up to n_tokens are identified by a hash and stay in the KV cache.
+struct SessionCheckpoint {
+    size_t n_tokens = 0;
+    size_t text_length = 0;
+    uint64_t tokens_hash = 0;
+    std::map<std::string, std::string> variables;
+};
+
+class CompiledProgram;
+
 class LLMSession {
 private:
     struct Impl;
     std::unique_ptr<Impl> pImpl;
 
+    explicit LLMSession(std::unique_ptr<Impl> impl);
+
 public:
     LLMSession(const std::string & model_path, int context_length = 2048, bool quiet = true);
+
+    // Throws std::runtime_error if the config is invalid. The model comes from
+    // ModelHandle::load(), so sessions on the same file share its weights.
+    LLMSession(const std::string & model_path, const SessionConfig & config);
+
+    // A new context on an already loaded model; config's load settings are not used
+    LLMSession(const ModelHandle & model, const SessionConfig & config = SessionConfig());
     ~LLMSession();
 
     LLMSession(const LLMSession&) = delete;
     LLMSession& operator=(const LLMSession&) = delete;
 
+    // Returns a session continuing from this one on its own sequence of the same context.
+    // The KV cache of the current context is shared with llama_memory_seq_cp, not copied, so
+    // a branch only costs memory for the tokens it adds. Text, tokens, variables, settings
+    // and limits are copied. Sessions sharing a context must be used from one thread; the
+    // model and context live until the last of them is destroyed. The context has 16
+    // sequences, shared with generate_n and beam search; throws std::runtime_error if none
+    // is free.
+    std::unique_ptr<LLMSession> fork() const;
+
+    // Loads a smaller model sharing this model's tokenizer for speculative decoding in
+    // generate(). The draft proposes up to n_draft tokens under the same constraints and the
+    // target verifies them in one batch; output is the same as without a draft. The draft is
+    // shared with forked sessions. Throws std::runtime_error if the vocabularies differ in
+    // size, BOS/EOS ids or a sample of token pieces.
+    void set_draft_model(const std::string & model_path, int n_draft = 8);
+
+    // The config with defaults resolved to the values the context uses
+    SessionConfig get_config() const;
+
+    ModelHandle get_model() const;
+
+    // One line of key=value pairs describing get_config(), for logs
+    std::string describe() const;
+
+    // Estimates the memory of a session with config without creating one; only the model's
+    // metadata and vocabulary are read
+    static MemoryEstimate estimate_memory(const std::string & model_path, const SessionConfig & config = SessionConfig());
+
+    // Sizes context_length for prompt_tokens + max_new_tokens (rounded up to 256) and halves
+    // n_ubatch until session_bytes() fits budget_bytes. Other settings are kept from base.
+    // Throws if the context exceeds the model's training context or cannot fit.
+    static SessionConfig plan_config(
+        const std::string & model_path,
+        int prompt_tokens,
+        int max_new_tokens,
+        size_t budget_bytes,
+        const SessionConfig & base = SessionConfig()
+    );
+
+    // The estimate for this session's config, with state_bytes measured for the current context
+    MemoryEstimate memory_usage() const;
+
+    CompiledOptions compile_options(const std::vector<std::string> & options) const;
+
+    CompiledStops compile_stops(const std::vector<std::string> & stop_sequences) const;
+
+    CompiledPattern compile_pattern(
+        PatternType pattern,
+        const std::string & regex_pattern = "",
+        const std::vector<std::string> & stop_sequences = std::vector<std::string>()
+    ) const;
+
     std::string select(const std::vector<std::string> & options, const std::string & var_name = "");
 
+    // Throws std::runtime_error if options were compiled for another model
+    std::string select(const CompiledOptions & options, const std::string & var_name = "");
+
     std::string generate(int max_tokens = 50, float temperature = 0.7f, const std::string & var_name = "");
 
     std::string generate(
@@ -44,18 +298,142 @@ public:
 
     std::string generate(const GenerateOptions & options);
 
+    // Samples n independent continuations of the current context in one batched decode
+    // per step, sharing the prompt KV. Sample i uses seed options.seed + i. The session
+    // context is left unchanged; min_tokens, var_name and on_text are ignored.
+    std::vector<std::string> generate_n(int n, const GenerateOptions & options);
+
+    // Fills independent fields from the current context at once. Each field continues the
+    // context with its prompt on its own sequence (the context's KV is shared, not copied)
+    // and all fields are decoded together, one batch per step, so the call takes about as
+    // long as its longest field rather than the sum. The context is left unchanged; values
+    // are returned by name and stored as variables. Greedy values equal those of fork(),
+    // += prompt and select / generate. Fields beyond the free sequences run in further rounds.
+    std::map<std::string, std::string> fan_out(const std::vector<FanOutField> & fields);
+
+    // Parses a template program (see prompt_program.h); throws std::runtime_error on a
+    // syntax error. The program can be run by any session on the same model.
+    CompiledProgram compile_program(const std::string & source) const;
+
+    // Appends the program's text and fills its holes in order, returning the values of the
+    // named ones (also stored as variables). The last tokens of a hole and the text after it
+    // are evaluated in one batch, so a program costs about one prefill per hole plus the
+    // sampling steps. Throws std::runtime_error for a missing input or a program compiled
+    // for another model. Stops at an interrupted hole; get_last_stats() sums the holes.
+    std::map<std::string, std::string> run(
+        const CompiledProgram & program,
+        const std::map<std::string, std::string> & inputs = std::map<std::string, std::string>()
+    );
+    // Compiles source through a per-session cache, like select() with a list of options
+    std::map<std::string, std::string> run(
+        const std::string & source,
+        const std::map<std::string, std::string> & inputs = std::map<std::string, std::string>()
+    );
+
+    // Counts and stop reason of the last select, generate, generate_n, fan_out, run or += call
+    GenerationStats get_last_stats() const;
+
+    // Score every token chosen by select and generate (see token_logprob), reported in
+    // get_last_stats().logprobs. Costs about one pass over the logits row per token.
+    void enable_logprobs(bool enable = true);
+
+    // Lets the session run past the context length at a fixed memory footprint. When a decode
+    // would not fit, the first n_sink tokens (attention sinks: the BOS token, or a whole system
+    // prompt) are kept, n_discard tokens after them are dropped with llama_memory_seq_rm and
+    // the rest is moved back with llama_memory_seq_add; n_discard = 0 drops half of the tokens
+    // after the sinks. get_output() and the tracked tokens follow the cache, so the dropped
+    // text disappears from them, and only checkpoints within the sinks survive a shift. Tokens
+    // generated by the running call are never dropped, and no shift is done while forks share
+    // the context: a call that needs one then throws std::runtime_error, keeping what it had
+    // decoded. Throws std::runtime_error if the model's memory cannot be shifted.
+    void enable_context_shift(bool enable = true, int n_sink = 4, int n_discard = 0);
+
+    // Buffers the text of += (and of the stop sequences completed by generate) instead of
+    // evaluating it at once; the next select, generate, save or fork evaluates all of it in
+    // one prefill together, with the same tokens as eager evaluation. The call limits and
+    // prefill callback then apply to that call: if it is interrupted while evaluating the
+    // buffered text, it returns "" and the text stays buffered for the next call.
+    void enable_lazy_prefill(bool enable = true);
+
+    // Limits for every following call until cleared, checked between decode batches (prompts
+    // are evaluated in n_ubatch chunks). An interrupted generate returns the partial text, an
+    // interrupted select or += is rolled back; get_last_stats().reason tells which happened.
+    // The KV cache and tracked tokens stay consistent either way.
+    void set_cancel_token(const CancelToken & token);
+    void set_deadline(std::chrono::steady_clock::time_point deadline);
+    void clear_limits();
+
+    // Called after each n_ubatch chunk of text evaluated into the context (+= and the stop
+    // sequences appended after generate). Returning false stops like a cancel, with
+    // STOP_CALLBACK as the reason. Pass nullptr to remove.
+    void set_prefill_callback(std::function<bool(const PrefillProgress & progress)> callback);
+
     LLMSession& operator+=(const std::string & text);
 
+    // Asynchronous +=, select and generate. Calls run in the order they were made on an
+    // executor thread shared with this session's forks (started by the first call), so they
+    // overlap the caller's own work and sessions on other contexts run concurrently. done,
+    // if set, is called on the executor thread before the future becomes ready. Blocking
+    // calls on the session or its forks, and the destructor, first wait for pending calls;
+    // from done they run at once, and a session destroyed there is freed after its calls.
+    std::future<void> append_async(const std::string & text, AsyncCallback done = nullptr);
+    std::future<std::string> select_async(
+        const std::vector<std::string> & options,
+        const std::string & var_name = "",
+        AsyncCallback done = nullptr
+    );
+    std::future<std::string> generate_async(const GenerateOptions & options, AsyncCallback done = nullptr);
+
+    // Replaces the context with text (as clear() then += would) but keeps the KV cache of the
+    // longest token prefix it shares with the current context and evaluates only the rest, like
+    // the llama.cpp server's cache_prompt. Suits multi-turn chat and a fixed system prompt
+    // followed by different questions. Variables are kept. An interrupted call leaves the
+    // shared prefix as the context. Reports tokens_reused in get_last_stats().
+    void set_prompt(const std::string & text);
+
     std::string get_output() const;
 
+    // Output offsets count every byte since the last clear(), set_prompt() or load_context*(),
+    // including text dropped since by the context shift or the retention limit, so an offset
+    // keeps pointing at the same text while the session grows. get_output_end() is the
+    // offset after the last byte; get_output_since() copies only what follows offset, so
+    // polling once per turn costs the new text rather than the whole transcript.
+    size_t get_output_end() const;
+    std::string get_output_since(size_t offset) const;
+
+    // Passes the stored output from offset on to visit in the chunks it is kept in, without
+    // copying. The pointers are valid until the session next changes.
+    void read_output(size_t offset, const std::function<void(const char * text, size_t length)> & visit) const;
+
+    // Keeps at least the last max_bytes of output, dropping older text in 4 KB chunks so a
+    // long session has bounded memory; 0 (the default) keeps everything. Dropped text leaves
+    // get_output() and saved contexts but not the KV cache, and offsets stay valid.
+    void set_output_retention(size_t max_bytes);
+
     std::string get_variable(const std::string & var_name) const;
 
     std::map<std::string, std::string> get_variables() const;
 
+    // Empties the context, including this session's KV cache, and the variables
     void clear();
 
+    // Marks the current position, e.g. after a system prompt, to return to with rollback()
+    SessionCheckpoint checkpoint() const;
+
+    // Truncates the KV cache to the checkpoint with llama_memory_seq_rm and restores the text
+    // and variables, without touching the saved state. Returns false, changing nothing, if the
+    // context no longer starts with the checkpoint's tokens (cleared or replaced since). A
+    // checkpoint taken before fork() is valid in both sessions.
+    bool rollback(const SessionCheckpoint & checkpoint);
+
     bool save_context(const std::string & filepath) const;
 
+    // Contexts are saved per sequence, so a snapshot can be loaded into any forked session.
+    // Here and in load_context_from_memory, when the saved tokens are a prefix of the current
+    // context (e.g. a cached system prompt loaded back after a turn) the KV cache is truncated
+    // instead of restoring the saved state. Snapshots from versions that saved the whole
+    // context still load into a session that has no forks, and are rejected otherwise; when
+    // the saved state fails to load, the session is left empty.
     bool load_context(const std::string & filepath);
 
     std::vector<uint8_t> save_context_to_memory() const;
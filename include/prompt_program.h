@@ -0,0 +1,59 @@
+#ifndef PROMPT_PROGRAM_H
+#define PROMPT_PROGRAM_H
+
+#include "constrained_llm.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+// A guidance-style prompt template parsed once into steps for LLMSession::run():
+//
+//   <input>{{question}}</input>
+//   Verdict: {{#select 'verdict'}}Yes{{or}}No{{/select}}
+//   Because {{gen 'reason' max_tokens=60 stop='\n' temperature=0}}
+//
+// Literal text is tokenized when the program is compiled. {{name}} inserts an input passed to
+// run() or a variable set earlier. {{gen ['name'] key=value ...}} takes max_tokens,
+// min_tokens, temperature, seed, stop (repeatable), pattern (numeric, alpha, alphanumeric,
+// uppercase, lowercase, capitalized) and regex; {{#select ['name']}}a{{or}}b{{/select}}
+// chooses one of the options. Names are letters, digits, _, . and - and do not start with a
+// digit. Values are bare or quoted with ' or ", where \n, \t, \\ and the quotes can be
+// escaped; integers must fit an int (seed: a uint32_t). Like the other compiled handles a program is immutable, cheap
+// to copy and can be run by every session on the model it was compiled for.
+class CompiledProgram {
+public:
+    struct Step {
+        enum Kind {
+            TEXT,
+            INPUT,
+            SELECT,
+            GENERATE
+        };
+
+        Kind kind;
+        std::string text;                   // TEXT: the literal; INPUT: the input's name
+        std::vector<llama_token> tokens;    // TEXT: the literal without special tokens
+        std::string var_name;               // SELECT, GENERATE; empty if not stored
+        CompiledOptions options;            // SELECT
+        GenerateOptions generate;           // GENERATE, with compiled_stops / compiled_pattern
+    };
+
+    struct Data {
+        const llama_vocab * vocab;
+        std::string source;
+        std::vector<Step> steps;
+    };
+
+    CompiledProgram() {}
+    // Throws std::runtime_error describing the first syntax error
+    CompiledProgram(const struct llama_vocab * vocab, const std::string & source);
+
+    bool empty() const { return !data; }
+    const Data & get() const { return *data; }
+    const std::shared_ptr<const Data> & shared() const { return data; }
+
+private:
+    std::shared_ptr<const Data> data;
+};
+
+#endif
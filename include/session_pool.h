@@ -0,0 +1,130 @@
+#ifndef SESSION_POOL_H
+#define SESSION_POOL_H
+
+#include "constrained_llm.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+
+// Counters of a SessionPool's scheduler since it was created
+struct PoolStats {
+    long batches = 0;               // llama_decode calls
+    long generated_tokens = 0;      // sampled tokens decoded
+    long prompt_tokens = 0;         // prompt tokens decoded
+    int max_batch_sessions = 0;     // most sessions sharing one batch
+    double decode_ms = 0.0;         // time spent in llama_decode
+
+    double tokens_per_batch() const {
+        return batches > 0 ? (double) (generated_tokens + prompt_tokens) / batches : 0.0;
+    }
+};
+
+// A conversation served by a SessionPool. It owns a sequence of the pool's context and its
+// own tokens, text, variables and samplers, but no llama_context. Calls on one session run
+// in the order they were made, calls on different sessions run together; the blocking
+// calls wait for the pool's scheduler, the *_async ones return at once. Any thread may
+// make calls.
+class PooledSession {
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+
+    friend class SessionPool;
+    explicit PooledSession(std::unique_ptr<Impl> impl);
+
+public:
+    ~PooledSession();
+
+    PooledSession(const PooledSession &) = delete;
+    PooledSession & operator=(const PooledSession &) = delete;
+
+    PooledSession & operator+=(const std::string & text);
+
+    // Calls that queue behind the session's earlier calls and complete on the scheduler
+    // thread, so a few threads can drive many sessions. done, if set, runs on that thread
+    // before the future becomes ready and delays the next batch: keep it short, and make no
+    // blocking pool calls from it. The destructor waits for pending calls, except on the
+    // scheduler thread (e.g. from done), where the session is released once they finish.
+    std::future<void> append_async(const std::string & text, AsyncCallback done = nullptr);
+    std::future<std::string> select_async(
+        const std::vector<std::string> & options,
+        const std::string & var_name = "",
+        AsyncCallback done = nullptr
+    );
+    std::future<std::string> select_async(
+        const CompiledOptions & options,
+        const std::string & var_name = "",
+        AsyncCallback done = nullptr
+    );
+    std::future<std::string> generate_async(const GenerateOptions & options, AsyncCallback done = nullptr);
+
+    std::string select(const std::vector<std::string> & options, const std::string & var_name = "");
+    std::string select(const CompiledOptions & options, const std::string & var_name = "");
+
+    std::string generate(
+        int max_tokens,
+        const std::vector<std::string> & stop_sequences = {},
+        float temperature = 0.7f,
+        const std::string & var_name = ""
+    );
+    // min_tokens, on_text, prompt_lookup and n_beams are not supported by pooled sessions
+    std::string generate(const GenerateOptions & options);
+
+    std::string get_output() const;
+    std::string get_variable(const std::string & var_name) const;
+    std::map<std::string, std::string> get_variables() const;
+    GenerationStats get_last_stats() const;
+
+    // Limits checked by the scheduler before each batch, as for LLMSession. An interrupted
+    // generate returns the partial text, an interrupted select or += is rolled back.
+    void set_cancel_token(const CancelToken & token);
+    void set_deadline(std::chrono::steady_clock::time_point deadline);
+    void clear_limits();
+
+    void clear();
+};
+
+// Serves many PooledSessions from one llama_context. Each session is a sequence of the
+// context, and a scheduler thread merges the next decode step of every generating session
+// and chunks of pending prompts into one llama_batch per iteration, so concurrent sessions
+// share each forward pass. Decode steps are batched first; prompts fill the rest of the
+// batch up to prefill_chunk tokens per iteration, so a long prompt does not stall the
+// sessions already generating. config.context_length (2048 by default) is shared by all
+// sessions, so one session may use all of it while it is alone; size it for the sessions
+// expected at once. A call that finds the shared cache full throws std::runtime_error and
+// leaves its session as it was, while the other sessions in the batch carry on.
+class SessionPool {
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+
+public:
+    // prefill_chunk defaults to the context's n_ubatch
+    SessionPool(const ModelHandle & model, const SessionConfig & config = SessionConfig(),
+                int max_sessions = 16, int prefill_chunk = 0);
+    // Stops the scheduler; calls still waiting on it throw std::runtime_error
+    ~SessionPool();
+
+    SessionPool(const SessionPool &) = delete;
+    SessionPool & operator=(const SessionPool &) = delete;
+
+    // Throws std::runtime_error when max_sessions sessions are open
+    std::unique_ptr<PooledSession> open();
+    int open_sessions() const;
+    int max_sessions() const;
+
+    CompiledOptions compile_options(const std::vector<std::string> & options) const;
+    CompiledStops compile_stops(const std::vector<std::string> & stop_sequences) const;
+    CompiledPattern compile_pattern(
+        PatternType pattern,
+        const std::string & regex_pattern = "",
+        const std::vector<std::string> & stop_sequences = {}
+    ) const;
+
+    PoolStats get_stats() const;
+    const SessionConfig & get_config() const;
+};
+
+#endif
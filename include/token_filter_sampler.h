@@ -5,6 +5,8 @@
 #include <vector>
 #include <unordered_set>
 #include <string>
+#include <memory>
+#include <regex>
 
 enum PatternType {
     PATTERN_NONE = 0,
@@ -17,6 +19,82 @@ enum PatternType {
     PATTERN_REGEX
 };
 
+// Pre-tokenized constraint handles. Compile once and pass to select()/generate();
+// the data is immutable, so handles are cheap to copy and safe to share across threads.
+class CompiledOptions {
+public:
+    struct Data {
+        const llama_vocab * vocab;
+        std::vector<std::string> options;
+        std::vector<std::vector<llama_token>> option_tokens;
+        size_t max_length;
+    };
+
+    CompiledOptions() {}
+    CompiledOptions(const struct llama_vocab * vocab, const std::vector<std::string> & options);
+
+    bool empty() const { return !data; }
+    const Data & get() const { return *data; }
+    const std::shared_ptr<const Data> & shared() const { return data; }
+
+private:
+    std::shared_ptr<const Data> data;
+};
+
+class CompiledStops {
+public:
+    struct Partial {
+        std::string text;
+        std::unordered_set<llama_token> allowed_tokens;
+    };
+
+    struct Data {
+        const llama_vocab * vocab;
+        std::vector<std::string> sequences;
+        std::unordered_set<llama_token> stop_tokens;
+        // Partial tag matches in the order the stop sequence sampler checks them
+        std::vector<Partial> partials;
+        size_t max_partial_length;
+    };
+
+    CompiledStops() {}
+    CompiledStops(const struct llama_vocab * vocab, const std::vector<std::string> & stop_sequences);
+
+    bool empty() const { return !data; }
+    const Data & get() const { return *data; }
+    const std::shared_ptr<const Data> & shared() const { return data; }
+
+private:
+    std::shared_ptr<const Data> data;
+};
+
+class CompiledPattern {
+public:
+    struct Data {
+        const llama_vocab * vocab;
+        PatternType pattern;
+        std::string regex_pattern;
+        bool regex_valid;
+        std::regex regex;
+        std::unordered_set<llama_token> stop_tokens;
+    };
+
+    CompiledPattern() {}
+    CompiledPattern(
+        const struct llama_vocab * vocab,
+        PatternType pattern,
+        const std::string & regex_pattern = "",
+        const std::vector<std::string> & stop_sequences = std::vector<std::string>()
+    );
+
+    bool empty() const { return !data; }
+    const Data & get() const { return *data; }
+    const std::shared_ptr<const Data> & shared() const { return data; }
+
+private:
+    std::shared_ptr<const Data> data;
+};
+
 struct llama_sampler * llama_sampler_init_token_filter(
     const std::vector<llama_token> & allowed_tokens,
     bool is_allowlist = true
@@ -37,6 +115,8 @@ struct llama_sampler * llama_sampler_init_prefix_select(
     const std::vector<std::string> & options
 );
 
+struct llama_sampler * llama_sampler_init_prefix_select(const CompiledOptions & options);
+
 struct llama_sampler * llama_sampler_init_pattern(
     const struct llama_vocab * vocab,
     PatternType pattern,
@@ -44,9 +124,18 @@ struct llama_sampler * llama_sampler_init_pattern(
     const std::vector<std::string> & stop_sequences = std::vector<std::string>()
 );
 
+struct llama_sampler * llama_sampler_init_pattern(const CompiledPattern & pattern);
+
 struct llama_sampler * llama_sampler_init_stop_sequence(
     const struct llama_vocab * vocab,
     const std::vector<std::string> & stop_sequences
 );
 
+struct llama_sampler * llama_sampler_init_stop_sequence(const CompiledStops & stops);
+
+// Returns true and stores the token when the constraint samplers in smpl (a single
+// sampler or a chain) allow exactly one next token. Chains containing samplers other
+// than the constraints above and temp/dist/greedy never report a forced token.
+bool llama_sampler_get_forced_token(const struct llama_sampler * smpl, llama_token * token);
+
 #endif
@@ -29,6 +29,12 @@ TESTS=(
     "multitoken_test:Multi-token handling"
     "thinking_chat_example:Structured thinking"
     "memory_agent_example:3-way agent choices"
+    "context_memory_example:Snapshots and branching"
+    "streaming_example:Streaming callbacks"
+    "self_consistency_example:Parallel sampling with generate_n"
+    "prompt_program_example:Compiled template programs"
+    "fan_out_example:Parallel field extraction"
+    "session_pool_benchmark:Pooled sessions in shared batches"
 )
 
 PASSED=0
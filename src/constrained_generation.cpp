@@ -1,19 +1,610 @@
 #include "constrained_generation.h"
 #include "token_filter_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
-static bool check_stop_sequence(
-    const std::string & generated_text,
-    const std::vector<std::string> & stop_sequences,
-    std::string & found_sequence
+// Builds the default chain: [custom] [stop sequence] temp dist. Takes ownership of params.custom_sampler.
+static llama_sampler * build_sampler_chain(const struct llama_vocab * vocab, const generate_params & params) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+
+    if (params.custom_sampler) {
+        llama_sampler_chain_add(smpl, params.custom_sampler);
+    }
+
+    // Add stop sequence sampler if stop sequences are provided
+    if (!params.stop_sequences.empty()) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_stop_sequence(vocab, params.stop_sequences));
+    }
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
+    return smpl;
+}
+
+// Clones a chain with its current state, replacing the dist sampler with one using seed
+static llama_sampler * clone_chain_with_seed(const llama_sampler * chain, uint32_t seed) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+
+    for (int i = 0; i < llama_sampler_chain_n(chain); i++) {
+        const llama_sampler * member = llama_sampler_chain_get(chain, i);
+        if (std::strcmp(llama_sampler_name(member), "dist") == 0) {
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+        } else {
+            llama_sampler_chain_add(smpl, llama_sampler_clone(member));
+        }
+    }
+    return smpl;
+}
+
+// A token can only complete a stop sequence if its text contains the last byte of one;
+// other tokens are decoded before their text is examined
+struct stop_filter {
+    bool last_byte[256];
+    bool any;
+
+    explicit stop_filter(const std::vector<std::string> & stop_sequences) : any(false) {
+        std::fill(last_byte, last_byte + 256, false);
+        for (const auto & seq : stop_sequences) {
+            if (seq.empty()) {
+                any = true;
+            } else {
+                last_byte[(unsigned char) seq.back()] = true;
+            }
+        }
+    }
+
+    bool may_complete(const char * piece, int n) const {
+        if (any) {
+            return true;
+        }
+        for (int k = 0; k < n; k++) {
+            if (last_byte[(unsigned char) piece[k]]) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Appends a token's text to the result and checks the stop sequences. Only matches ending
+// in the new text are searched for, earlier text was checked when it was appended.
+static void append_piece(
+    const generate_params & params,
+    generate_result & result,
+    llama_token token,
+    const char * piece,
+    int n
 ) {
+    size_t old_length = result.text.length();
+    result.text.append(piece, n);
+    result.tokens.push_back(token);
+    result.tokens_generated++;
+
+    for (const auto & seq : params.stop_sequences) {
+        size_t from = seq.empty() ? 0 : old_length + 1 - std::min(old_length + 1, seq.length());
+        size_t pos = result.text.find(seq, from);
+        if (pos != std::string::npos) {
+            result.stopped_by_sequence = true;
+            result.stop_sequence = seq;
+
+            // Remove stop sequence from returned text
+            result.text.resize(pos);
+            return;
+        }
+    }
+}
+
+// Appends a non-EOG token's text to the result and checks the stop sequences.
+// Returns false if the token produced no text.
+static bool append_token(
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    generate_result & result,
+    llama_token token
+) {
+    char buf[256];
+    int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+    if (n <= 0) {
+        return false;
+    }
+    append_piece(params, result, token, buf, n);
+    return true;
+}
+
+// Length of the longest suffix of text that is a proper prefix of a stop sequence
+static size_t stop_prefix_holdback(const std::string & text, const std::vector<std::string> & stop_sequences) {
+    size_t holdback = 0;
     for (const auto & seq : stop_sequences) {
-        if (generated_text.find(seq) != std::string::npos) {
-            found_sequence = seq;
+        size_t max_len = std::min(seq.length() - 1, text.length());
+        for (size_t len = max_len; len > holdback; len--) {
+            if (text.compare(text.length() - len, len, seq, 0, len) == 0) {
+                holdback = len;
+                break;
+            }
+        }
+    }
+    return holdback;
+}
+
+// Moves end back so that [0, end) does not split a UTF-8 sequence
+static size_t utf8_safe_end(const std::string & text, size_t end) {
+    size_t lead = end;
+    int continuation = 0;
+    while (lead > 0 && continuation < 3 && ((unsigned char) text[lead - 1] & 0xC0) == 0x80) {
+        lead--;
+        continuation++;
+    }
+    if (lead == 0) {
+        return end;
+    }
+    lead--;
+
+    unsigned char c = (unsigned char) text[lead];
+    size_t needed = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return end - lead < needed ? lead : end;
+}
+
+// Emits the part of the generated text that can no longer change
+struct text_stream {
+    const std::function<bool(const char *, size_t)> & callback;
+    const std::vector<std::string> & stop_sequences;
+    size_t emitted;
+
+    bool emit(const std::string & text, bool final) {
+        size_t end = text.length();
+        if (!final) {
+            end = utf8_safe_end(text, end - stop_prefix_holdback(text, stop_sequences));
+        }
+        if (end <= emitted) {
             return true;
         }
+        bool keep_going = callback(text.data() + emitted, end - emitted);
+        emitted = end;
+        return keep_going;
     }
-    return false;
+};
+
+bool sample_forced_token(llama_sampler * smpl, llama_token * token) {
+    llama_token forced;
+    if (!llama_sampler_get_forced_token(smpl, &forced)) {
+        return false;
+    }
+
+    // Run the chain over the single surviving candidate so sampler state (including
+    // the dist RNG) advances exactly as llama_sampler_sample() would have
+    llama_token_data candidate = { forced, 0.0f, 0.0f };
+    llama_token_data_array cur = { &candidate, 1, -1, false };
+    llama_sampler_apply(smpl, &cur);
+    llama_sampler_accept(smpl, forced);
+
+    *token = forced;
+    return true;
+}
+
+// exp(x) for finite x <= 0 (Cephes range reduction and polynomial). No branches, selects or
+// library calls, so loops over a logits row vectorize at -O3 without -ffast-math.
+static inline float exp_nonpositive(float x) {
+    x -= (float) (x < -87.0f) * (x + 87.0f);
+    int n = (int) (x * 1.44269504f - 0.5f);
+    float fn = (float) n;
+    float r = x - fn * 0.693359375f + fn * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    int32_t bits = (n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// Independent accumulators per position in a block of the row, so that the reductions
+// vectorize without reassociating floating point sums
+static const int LOGIT_LANES = 64;
+
+static float row_max(const float * row, int n) {
+    float lanes[LOGIT_LANES];
+    std::fill(lanes, lanes + LOGIT_LANES, -INFINITY);
+    int i = 0;
+    for (; i + LOGIT_LANES <= n; i += LOGIT_LANES) {
+        for (int j = 0; j < LOGIT_LANES; j++) {
+            lanes[j] = lanes[j] < row[i + j] ? row[i + j] : lanes[j];
+        }
+    }
+    float max = *std::max_element(lanes, lanes + LOGIT_LANES);
+    for (; i < n; i++) {
+        max = std::max(max, row[i]);
+    }
+    return max;
+}
+
+// Sum of exp(row[i] - max) fused with the count of entries above value
+static float row_sum_exp(const float * row, int n, float max, float value, int * n_above) {
+    float sums[LOGIT_LANES] = {};
+    int counts[LOGIT_LANES] = {};
+    int i = 0;
+    for (; i + LOGIT_LANES <= n; i += LOGIT_LANES) {
+        for (int j = 0; j < LOGIT_LANES; j++) {
+            sums[j] += exp_nonpositive(row[i + j] - max);
+            counts[j] += row[i + j] > value;
+        }
+    }
+    float sum = 0.0f;
+    int count = 0;
+    for (int j = 0; j < LOGIT_LANES; j++) {
+        sum += sums[j];
+        count += counts[j];
+    }
+    for (; i < n; i++) {
+        sum += exp_nonpositive(row[i] - max);
+        count += row[i] > value;
+    }
+    *n_above = count;
+    return sum;
+}
+
+static bool is_sampling_stage(const llama_sampler * smpl) {
+    const char * name = llama_sampler_name(smpl);
+    return std::strcmp(name, "temp") == 0 || std::strcmp(name, "dist") == 0 || std::strcmp(name, "greedy") == 0;
+}
+
+llama_token sample_token(llama_sampler * smpl, llama_context * ctx, int32_t idx, token_logprob * out) {
+    if (!out) {
+        return llama_sampler_sample(smpl, ctx, idx);
+    }
+
+    const float * logits = llama_get_logits_ith(ctx, idx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const float max = row_max(logits, n_vocab);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur[id] = { id, logits[id], 0.0f };
+    }
+    llama_token_data_array arr = { cur.data(), (size_t) n_vocab, -1, false };
+
+    // Same as llama_sampler_apply() on the chain, but the candidates are inspected once the
+    // constraints ran. The smaller of the kept and removed sets is summed.
+    bool measured = false;
+    bool sum_removed = false;
+    double constrained_sum = 0.0;
+    const int n_members = llama_sampler_chain_n(smpl);
+    for (int k = 0; k <= n_members; k++) {
+        llama_sampler * member = k < n_members ? llama_sampler_chain_get(smpl, k) : nullptr;
+        if (!measured && (!member || is_sampling_stage(member))) {
+            measured = true;
+            size_t n_kept = 0;
+            for (size_t c = 0; c < arr.size; c++) {
+                n_kept += arr.data[c].logit != -INFINITY;
+            }
+            sum_removed = arr.size == (size_t) n_vocab && n_kept * 2 > arr.size;
+            for (size_t c = 0; c < arr.size; c++) {
+                if ((arr.data[c].logit == -INFINITY) == sum_removed) {
+                    constrained_sum += exp_nonpositive(logits[arr.data[c].id] - max);
+                }
+            }
+        }
+        if (member) {
+            llama_sampler_apply(member, &arr);
+        }
+    }
+    if (arr.selected < 0 || arr.selected >= (int64_t) arr.size) {
+        throw std::runtime_error("Sampler chain did not select a token");
+    }
+    llama_token token = arr.data[arr.selected].id;
+    llama_sampler_accept(smpl, token);
+
+    int n_above = 0;
+    double total = row_sum_exp(logits, n_vocab, max, logits[token], &n_above);
+    double removed = sum_removed ? constrained_sum : total - constrained_sum;
+
+    out->token = token;
+    out->logprob = logits[token] - max - (float) std::log(total);
+    out->rank = n_above;
+    out->removed_logmass = removed > 0.0 ? (float) (std::log(removed) - std::log(total)) : -INFINITY;
+    return token;
+}
+
+static void batch_add(llama_batch & batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    int i = batch.n_tokens++;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq_id;
+    batch.logits[i] = logits;
+}
+
+bool decode_tokens(llama_context * ctx, std::vector<llama_token> & tokens, llama_seq_id seq_id) {
+    const size_t n_batch = llama_n_batch(ctx);
+
+    if (seq_id == 0) {
+        for (size_t start = 0; start < tokens.size(); start += n_batch) {
+            size_t n = std::min(n_batch, tokens.size() - start);
+            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + start, n)) != 0) {
+                return false;
+            }
+        }
+        tokens.clear();
+        return true;
+    }
+    if (tokens.empty()) {
+        return true;
+    }
+
+    // llama_batch_get_one() only addresses sequence 0
+    const llama_pos n_past = llama_memory_seq_pos_max(llama_get_memory(ctx), seq_id) + 1;
+    llama_batch batch = llama_batch_init(std::min(n_batch, tokens.size()), 0, 1);
+    bool ok = true;
+    for (size_t start = 0; start < tokens.size() && ok; start += n_batch) {
+        size_t n = std::min(n_batch, tokens.size() - start);
+        batch.n_tokens = 0;
+        for (size_t k = 0; k < n; k++) {
+            batch_add(batch, tokens[start + k], n_past + start + k, seq_id, k + 1 == n);
+        }
+        ok = llama_decode(ctx, batch) == 0;
+    }
+    llama_batch_free(batch);
+
+    if (ok) {
+        tokens.clear();
+    }
+    return ok;
+}
+
+llama_sampler * clone_constraint_chain(const llama_sampler * chain) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+
+    for (int i = 0; i < llama_sampler_chain_n(chain); i++) {
+        const llama_sampler * member = llama_sampler_chain_get(chain, i);
+        const char * name = llama_sampler_name(member);
+        if (std::strcmp(name, "temp") != 0 && std::strcmp(name, "dist") != 0 && std::strcmp(name, "greedy") != 0) {
+            llama_sampler_chain_add(smpl, llama_sampler_clone(member));
+        }
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    return smpl;
+}
+
+// N-gram index over the lookup tokens followed by the generated ones. Each n-gram maps to
+// the position after its most recent occurrence that already has a continuation.
+struct ngram_index {
+    int n_min;
+    int n_max;
+    std::vector<llama_token> tokens;
+    std::unordered_map<uint64_t, size_t> next;
+    size_t n_generated;
+
+    ngram_index(const std::vector<llama_token> & lookup_tokens, int ngram_min, int ngram_max)
+        : n_min(std::max(ngram_min, 1)), n_max(std::max(ngram_max, ngram_min)), n_generated(0) {
+        tokens.reserve(lookup_tokens.size() + 256);
+        next.reserve(lookup_tokens.size() * (n_max - n_min + 1));
+        for (llama_token token : lookup_tokens) {
+            add(token);
+        }
+    }
+
+    static uint64_t hash(const llama_token * ngram, int n) {
+        uint64_t h = 14695981039346656037ULL ^ (uint64_t) n;
+        for (int i = 0; i < n; i++) {
+            h = (h ^ (uint32_t) ngram[i]) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void add(llama_token token) {
+        // The n-grams ending just before this token now have a continuation
+        size_t end = tokens.size();
+        tokens.push_back(token);
+        for (int n = n_min; n <= n_max && (size_t) n <= end; n++) {
+            next[hash(&tokens[end - n], n)] = end;
+        }
+    }
+
+    void propose(const std::vector<llama_token> & generated, int n_draft, std::vector<llama_token> & draft) {
+        for (; n_generated < generated.size(); n_generated++) {
+            add(generated[n_generated]);
+        }
+
+        const size_t size = tokens.size();
+        for (int n = n_max; n >= n_min; n--) {
+            if ((size_t) n > size) {
+                continue;
+            }
+            auto it = next.find(hash(&tokens[size - n], n));
+            if (it == next.end()) {
+                continue;
+            }
+            size_t pos = it->second;
+            if (!std::equal(tokens.begin() + (pos - n), tokens.begin() + pos, tokens.end() - n)) {
+                continue;
+            }
+            for (size_t k = pos; k < size && (int) draft.size() < n_draft; k++) {
+                draft.push_back(tokens[k]);
+            }
+            return;
+        }
+    }
+};
+
+token_status take_token(
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    generate_result & result,
+    llama_token token
+) {
+    if (llama_vocab_is_eog(vocab, token)) {
+        result.reason = STOP_EOG;
+        return TOKEN_END;
+    }
+    if (!append_token(vocab, params, result, token)) {
+        return TOKEN_EMPTY;
+    }
+    if (result.stopped_by_sequence) {
+        result.reason = STOP_SEQUENCE;
+        return TOKEN_END;
+    }
+    return TOKEN_KEPT;
+}
+
+// Appends the text of pipelined tokens to the result on its own thread, so detokenizing,
+// the stop sequence search and streaming run while the loop decodes the next token. Only
+// tokens that have text and cannot complete a stop sequence are queued; the loop drains
+// the queue before it appends any other token itself. Without on_text the remaining work
+// costs less than handing it over, so tokens are appended when they are pushed.
+class text_pipeline {
+public:
+    text_pipeline(const struct llama_vocab * vocab, const generate_params & params, const stop_filter & stops,
+                  generate_result & result, text_stream & stream)
+        : vocab(vocab), params(params), stops(stops), result(result), stream(stream) {}
+
+    ~text_pipeline() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        ready.notify_one();
+        worker.join();
+    }
+
+    // Whether the token can be queued; each token id is detokenized here once per call
+    bool plain(llama_token token) {
+        if (classes.empty()) {
+            classes.assign(llama_vocab_n_tokens(vocab), 0);
+        }
+        if (token < 0 || (size_t) token >= classes.size()) {
+            return false;
+        }
+        unsigned char & c = classes[token];
+        if (c == 0) {
+            char piece[256];
+            int n = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+            c = n > 0 && !stops.may_complete(piece, n) ? 1 : 2;
+        }
+        return c == 1;
+    }
+
+    void push(llama_token token, const token_logprob * lp) {
+        entry e = { token, lp ? *lp : token_logprob(), lp != nullptr };
+        if (!params.on_text) {
+            append(e);
+            return;
+        }
+        if (!worker.joinable()) {
+            worker = std::thread(&text_pipeline::run, this);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(e);
+        ready.notify_one();
+    }
+
+    // Waits for the queued tokens; the result and stream are the caller's until the next push
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return queue.empty() && !busy; });
+    }
+
+    // Set once on_text has asked to stop; the tokens queued after that one are dropped
+    bool stopped() const {
+        return stop.load(std::memory_order_acquire);
+    }
+
+    size_t n_dropped() const {
+        return dropped;
+    }
+
+private:
+    struct entry {
+        llama_token token;
+        token_logprob lp;
+        bool has_lp;
+    };
+
+    const struct llama_vocab * vocab;
+    const generate_params & params;
+    const stop_filter & stops;
+    generate_result & result;
+    text_stream & stream;
+    std::vector<unsigned char> classes;   // 0 unseen, 1 queued, 2 appended by the loop
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable idle;
+    std::vector<entry> queue;
+    bool busy = false;
+    bool closing = false;
+    std::atomic<bool> stop{false};
+    size_t dropped = 0;
+    std::thread worker;
+
+    void append(const entry & e) {
+        append_token(vocab, params, result, e.token);
+        if (e.has_lp) {
+            result.logprobs.push_back(e.lp);
+        }
+        if (params.on_text && !stream.emit(result.text, false)) {
+            stop.store(true, std::memory_order_release);
+        }
+    }
+
+    void run() {
+        std::vector<entry> entries;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this] { return closing || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            entries.swap(queue);
+            busy = true;
+            lock.unlock();
+
+            for (const entry & e : entries) {
+                if (stop.load(std::memory_order_relaxed)) {
+                    dropped++;
+                } else {
+                    append(e);
+                }
+            }
+            entries.clear();
+
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+};
+
+// Score reported for tokens that were forced without evaluating the logits
+static token_logprob forced_logprob(llama_token token) {
+    token_logprob lp = { token, NAN, -1, NAN };
+    return lp;
+}
+
+stop_reason check_interrupt(const std::atomic<bool> * cancel, std::chrono::steady_clock::time_point deadline) {
+    if (cancel && cancel->load(std::memory_order_relaxed)) {
+        return STOP_CANCELLED;
+    }
+    if (deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline) {
+        return STOP_DEADLINE;
+    }
+    return STOP_NONE;
 }
 
 generate_result generate(
@@ -23,64 +614,732 @@ generate_result generate(
 ) {
     generate_result result;
 
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    llama_sampler * smpl = params.sampler;
+    bool owns_sampler = false;
 
-    if (params.custom_sampler) {
-        llama_sampler_chain_add(smpl, params.custom_sampler);
+    if (!smpl) {
+        smpl = build_sampler_chain(vocab, params);
+        owns_sampler = true;
     }
 
-    // Add stop sequence sampler if stop sequences are provided
-    if (!params.stop_sequences.empty()) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_stop_sequence(vocab, params.stop_sequences));
+    // Sampled tokens not yet decoded. Runs of constraint-forced tokens are collected
+    // here and decoded as one batch once the next token needs fresh logits.
+    std::vector<llama_token> pending;
+    pending.reserve(16);
+    result.tokens.reserve(std::min(std::max(params.max_tokens, 0), 4096));
+
+    text_stream stream = { params.on_text, params.stop_sequences, 0 };
+    stop_filter stops(params.stop_sequences);
+    text_pipeline text(vocab, params, stops, result, stream);
+
+    const int32_t n_batch = llama_n_batch(ctx);
+    const bool use_lookup = !params.drafter && params.lookup_tokens;
+    const bool speculate = (params.drafter || use_lookup) && params.n_draft > 0;
+    llama_batch batch = {};
+    std::vector<llama_token> draft;
+    std::unique_ptr<ngram_index> lookup;
+    if (speculate) {
+        batch = llama_batch_init(n_batch, 0, 1);
+    }
+    if (speculate && use_lookup) {
+        lookup.reset(new ngram_index(*params.lookup_tokens, params.lookup_ngram_min, params.lookup_ngram_max));
     }
+    // Drafting needs the text of every generated token, so speculation does not defer it
+    const bool pipeline = params.pipeline && !speculate;
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+    // After a verify batch with rejected proposals the last logits belong to a removed
+    // position until something else is decoded; tail_token is the last token kept
+    bool logits_stale = false;
+    llama_token tail_token = 0;
+
+    token_logprob lp = {};
+    token_logprob * lp_out = params.logprobs ? &lp : nullptr;
+
+    // Tokens whose decode failed; they left pending without reaching the KV cache
+    size_t n_failed = 0;
 
-    for (int i = 0; i < params.max_tokens; i++) {
-        llama_token new_token = llama_sampler_sample(smpl, ctx, -1);
-        // Note: llama_sampler_sample() already calls llama_sampler_accept() internally
+    int i = 0;
+    bool done = false;
+    while (!done && i < params.max_tokens && !text.stopped()) {
+        llama_token new_token;
+        if (params.jump_forward && sample_forced_token(smpl, &new_token)) {
+            result.tokens_forced++;
+            lp = forced_logprob(new_token);
+        } else {
+            // Everything below decodes, which is where limits are enforced
+            result.reason = check_interrupt(params.cancel, params.deadline);
+            if (result.reason != STOP_NONE) {
+                break;
+            }
+
+            draft.clear();
+            int n_max = std::min(params.n_draft, std::min(params.max_tokens - i, n_batch - (int) pending.size()));
+            if (speculate && !pending.empty() && n_max > 0) {
+                if (lookup) {
+                    lookup->propose(result.tokens, n_max, draft);
+                } else {
+                    params.drafter(result.tokens, smpl, n_max, draft);
+                }
+            }
+
+            if (draft.empty()) {
+                if (!pending.empty()) {
+                    logits_stale = false;
+                    if (params.make_room) {
+                        params.make_room(pending.size());
+                    }
+                }
+                if (!decode_tokens(ctx, pending, params.seq_id)) {
+                    std::cerr << "Failed to decode token" << std::endl;
+                    result.reason = STOP_ERROR;
+                    n_failed = pending.size();
+                    pending.clear();
+                    break;
+                }
+
+                new_token = sample_token(smpl, ctx, -1, lp_out);
+                // Note: sampling already calls llama_sampler_accept() internally
+            } else {
+                // Decode pending + draft in one batch, then sample along the draft for as
+                // long as the target agrees with it
+                if (params.make_room) {
+                    params.make_room(pending.size() + draft.size());
+                }
+                llama_memory_t mem = llama_get_memory(ctx);
+                llama_pos n_past = llama_memory_seq_pos_max(mem, params.seq_id) + 1;
+
+                batch.n_tokens = 0;
+                for (size_t k = 0; k < pending.size(); k++) {
+                    batch_add(batch, pending[k], n_past + k, params.seq_id, k + 1 == pending.size());
+                }
+                for (size_t k = 0; k < draft.size(); k++) {
+                    batch_add(batch, draft[k], n_past + pending.size() + k, params.seq_id, true);
+                }
+                if (llama_decode(ctx, batch) != 0) {
+                    std::cerr << "Failed to decode token" << std::endl;
+                    result.reason = STOP_ERROR;
+                    pending.clear();
+                    break;
+                }
+
+                llama_pos n_keep = n_past + pending.size();
+                int32_t idx = pending.size() - 1;
+                tail_token = pending.back();
+                pending.clear();
+                result.draft_proposed += draft.size();
+
+                size_t n_accepted = 0;
+                while (i < params.max_tokens) {
+                    llama_token token = sample_token(smpl, ctx, idx, lp_out);
+                    i++;
+
+                    token_status status = take_token(vocab, params, result, token);
+                    if (lp_out && result.logprobs.size() < result.tokens.size()) {
+                        result.logprobs.push_back(lp);
+                    }
+                    if (status == TOKEN_END) {
+                        done = true;
+                        break;
+                    }
+                    if (status == TOKEN_EMPTY) {
+                        continue;
+                    }
+
+                    // An accepted token is already in the KV cache at its position
+                    bool accepted = n_accepted < draft.size() && token == draft[n_accepted];
+                    if (accepted) {
+                        n_accepted++;
+                        n_keep++;
+                        idx++;
+                    } else {
+                        pending.push_back(token);
+                    }
+
+                    if (params.on_text && !stream.emit(result.text, false)) {
+                        result.stopped_by_callback = true;
+                        result.reason = STOP_CALLBACK;
+                        done = true;
+                        break;
+                    }
+                    if (!accepted) {
+                        break;
+                    }
+                }
+
+                result.draft_accepted += n_accepted;
+                llama_memory_seq_rm(mem, params.seq_id, n_keep, -1);
+                if (n_accepted > 0) {
+                    tail_token = draft[n_accepted - 1];
+                }
+                logits_stale = n_accepted < draft.size();
+                continue;
+            }
+        }
+        i++;
 
         if (llama_vocab_is_eog(vocab, new_token)) {
+            result.reason = STOP_EOG;
             break;
         }
 
-        char buf[256];
-        int n = llama_token_to_piece(vocab, new_token, buf, sizeof(buf), 0, false);
-        if (n > 0) {
-            std::string token_str(buf, n);
+        // Queue token for decoding into context
+        if (pipeline && text.plain(new_token)) {
+            pending.push_back(new_token);
+            text.push(new_token, lp_out);
+            continue;
+        }
+        if (pipeline) {
+            text.drain();
+            if (text.stopped()) {
+                break;
+            }
+        }
 
-            result.text += token_str;
-            result.tokens.push_back(new_token);
-            result.tokens_generated++;
+        char piece[256];
+        int n_piece = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, false);
+        if (n_piece <= 0) {
+            continue;
+        }
 
-            // Check for complete stop sequence
-            if (!params.stop_sequences.empty()) {
-                std::string found_seq;
-                if (check_stop_sequence(result.text, params.stop_sequences, found_seq)) {
-                    result.stopped_by_sequence = true;
-                    result.stop_sequence = found_seq;
+        append_piece(params, result, new_token, piece, n_piece);
+        if (lp_out) {
+            result.logprobs.push_back(lp);
+        }
+        if (result.stopped_by_sequence) {
+            result.reason = STOP_SEQUENCE;
+            break;
+        }
+        pending.push_back(new_token);
 
-                    // Remove stop sequence from returned text
-                    size_t pos = result.text.find(found_seq);
-                    if (pos != std::string::npos) {
-                        result.text = result.text.substr(0, pos);
-                    }
+        if (params.on_text && !stream.emit(result.text, false)) {
+            result.stopped_by_callback = true;
+            result.reason = STOP_CALLBACK;
+            break;
+        }
+    }
+
+    text.drain();
+    if (text.stopped()) {
+        // Tokens sampled after the one on_text stopped at are taken back, whether they are
+        // still pending or decoded already
+        result.stopped_by_callback = true;
+        if (result.reason != STOP_ERROR) {
+            result.reason = STOP_CALLBACK;
+        }
+        size_t n_drop = text.n_dropped();
+        size_t n_undecoded = std::min(n_drop, pending.size());
+        pending.resize(pending.size() - n_undecoded);
+        n_drop -= n_undecoded;
+        n_drop -= std::min(n_drop, n_failed);
+        if (n_drop > 0) {
+            llama_memory_t mem = llama_get_memory(ctx);
+            llama_memory_seq_rm(mem, params.seq_id, llama_memory_seq_pos_max(mem, params.seq_id) + 1 - n_drop, -1);
+            logits_stale = true;
+            tail_token = result.tokens.back();
+        }
+    }
+
+    if (params.leave_pending) {
+        // A stale tail is handed back too, so the caller's next decode refreshes its logits
+        if (pending.empty() && logits_stale) {
+            llama_memory_t mem = llama_get_memory(ctx);
+            llama_memory_seq_rm(mem, params.seq_id, llama_memory_seq_pos_max(mem, params.seq_id), -1);
+            result.n_pending = 1;
+        } else {
+            result.n_pending = pending.size();
+        }
+        logits_stale = false;
+    } else {
+        if (!pending.empty()) {
+            logits_stale = false;
+            if (params.make_room) {
+                params.make_room(pending.size());
+            }
+        }
+        if (!decode_tokens(ctx, pending, params.seq_id)) {
+            std::cerr << "Failed to decode token" << std::endl;
+            result.reason = STOP_ERROR;
+        }
+    }
+    if (logits_stale) {
+        llama_memory_t mem = llama_get_memory(ctx);
+        llama_memory_seq_rm(mem, params.seq_id, llama_memory_seq_pos_max(mem, params.seq_id), -1);
+        std::vector<llama_token> tail(1, tail_token);
+        if (!decode_tokens(ctx, tail, params.seq_id)) {
+            std::cerr << "Failed to decode token" << std::endl;
+            result.reason = STOP_ERROR;
+        }
+    }
+    if (result.reason == STOP_NONE) {
+        result.reason = STOP_MAX_TOKENS;
+    }
+
+    if (params.on_text && !result.stopped_by_callback) {
+        stream.emit(result.text, true);
+    }
+
+    if (speculate) {
+        llama_batch_free(batch);
+    }
+    if (owns_sampler) {
+        llama_sampler_free(smpl);
+    }
+    return result;
+}
+
+struct parallel_stream {
+    const generate_params * params;
+    const std::vector<std::vector<llama_token>> * option_tokens;
+    llama_sampler * smpl;
+    llama_seq_id seq_id;
+    llama_pos n_past;
+    generate_result result;
+    std::vector<llama_token> pending;
+    size_t pending_offset;
+    int steps;
+    bool done;
+    int32_t logits_idx;
+    bool has_logits;
+};
+
+static bool matches_option(const parallel_stream & stream) {
+    if (!stream.option_tokens) {
+        return false;
+    }
+    for (const auto & option : *stream.option_tokens) {
+        if (stream.result.tokens == option) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes the streams' pending tokens and samples them in lockstep, one batch per step,
+// until every stream is done. Each stream's sequence must hold its context already.
+static void run_streams(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    std::vector<parallel_stream> & streams,
+    const std::atomic<bool> * cancel,
+    std::chrono::steady_clock::time_point deadline
+) {
+    const int32_t n_batch = llama_n_batch(ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    const size_t quota = std::max<size_t>(1, n_batch / std::max<size_t>(1, streams.size()));
+
+    while (true) {
+        // Advance every stream until it needs fresh logits
+        for (auto & stream : streams) {
+            const generate_params & params = *stream.params;
+            while (!stream.done) {
+                if (stream.steps >= params.max_tokens) {
+                    stream.result.reason = STOP_MAX_TOKENS;
+                    stream.done = true;
+                    break;
+                }
+
+                llama_token new_token;
+                if (params.jump_forward && sample_forced_token(stream.smpl, &new_token)) {
+                    stream.result.tokens_forced++;
+                } else if (stream.has_logits) {
+                    new_token = llama_sampler_sample(stream.smpl, ctx, stream.logits_idx);
+                } else {
+                    break;
+                }
+                stream.steps++;
+
+                // Tokens without text are not decoded, so the current logits stay valid
+                token_status status = take_token(vocab, params, stream.result, new_token);
+                if (status == TOKEN_END) {
+                    stream.done = true;
+                    break;
+                }
+                if (matches_option(stream)) {
+                    stream.result.reason = STOP_NONE;
+                    stream.done = true;
                     break;
                 }
+                if (status == TOKEN_KEPT) {
+                    stream.pending.push_back(new_token);
+                    stream.has_logits = false;
+                }
             }
+        }
 
-            // Decode token into context
-            if (llama_decode(ctx, llama_batch_get_one(&new_token, 1)) != 0) {
-                std::cerr << "Failed to decode token" << std::endl;
-                break;
+        // One batch for all streams; finished streams are not decoded since their KV is discarded
+        batch.n_tokens = 0;
+        for (auto & stream : streams) {
+            if (stream.done) continue;
+
+            size_t take = std::min(quota, stream.pending.size() - stream.pending_offset);
+            for (size_t k = 0; k < take; k++) {
+                bool last = stream.pending_offset + 1 == stream.pending.size();
+                if (last) {
+                    stream.logits_idx = batch.n_tokens;
+                    stream.has_logits = true;
+                }
+                batch_add(batch, stream.pending[stream.pending_offset], stream.n_past, stream.seq_id, last);
+                stream.pending_offset++;
+                stream.n_past++;
+            }
+            if (stream.pending_offset == stream.pending.size()) {
+                stream.pending.clear();
+                stream.pending_offset = 0;
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        stop_reason reason = check_interrupt(cancel, deadline);
+        if (reason == STOP_NONE && llama_decode(ctx, batch) != 0) {
+            std::cerr << "Failed to decode batch" << std::endl;
+            reason = STOP_ERROR;
+        }
+        if (reason != STOP_NONE) {
+            for (auto & stream : streams) {
+                if (!stream.done) {
+                    stream.result.reason = reason;
+                }
             }
+            break;
         }
     }
 
-    llama_sampler_free(smpl);
-    return result;
+    llama_batch_free(batch);
+}
+
+// Copies src_seq into seq_id; the stream starts from the logits of src_seq's last token
+// unless it has a prompt to decode first
+static parallel_stream start_stream(
+    llama_context * ctx,
+    const generate_params & params,
+    llama_sampler * smpl,
+    llama_seq_id src_seq,
+    llama_seq_id seq_id,
+    const std::vector<llama_token> & prompt
+) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    parallel_stream stream;
+    stream.params = &params;
+    stream.option_tokens = nullptr;
+    stream.smpl = smpl;
+    stream.seq_id = seq_id;
+    stream.n_past = llama_memory_seq_pos_max(mem, src_seq) + 1;
+    stream.pending = prompt;
+    stream.pending_offset = 0;
+    stream.steps = 0;
+    stream.done = false;
+    stream.logits_idx = -1;
+    stream.has_logits = prompt.empty();
+
+    llama_memory_seq_rm(mem, seq_id, -1, -1);
+    llama_memory_seq_cp(mem, src_seq, seq_id, -1, -1);
+    return stream;
+}
+
+// Removes the streams' sequences and frees their samplers
+static std::vector<generate_result> finish_streams(llama_context * ctx, std::vector<parallel_stream> & streams) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    std::vector<generate_result> results;
+    results.reserve(streams.size());
+    for (auto & stream : streams) {
+        llama_memory_seq_rm(mem, stream.seq_id, -1, -1);
+        llama_sampler_free(stream.smpl);
+        results.push_back(stream.result);
+    }
+    return results;
+}
+
+std::vector<generate_result> generate_n(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids
+) {
+    llama_sampler * base = params.sampler;
+    if (!base) {
+        base = build_sampler_chain(vocab, params);
+    }
+
+    static const std::vector<llama_token> no_prompt;
+    std::vector<parallel_stream> streams;
+    streams.reserve(seq_ids.size());
+    for (size_t i = 0; i < seq_ids.size(); i++) {
+        llama_sampler * smpl = clone_chain_with_seed(base, params.seed + (uint32_t) i);
+        streams.push_back(start_stream(ctx, params, smpl, src_seq, seq_ids[i], no_prompt));
+    }
+
+    if (!params.sampler) {
+        llama_sampler_free(base);
+    }
+
+    run_streams(ctx, vocab, streams, params.cancel, params.deadline);
+    return finish_streams(ctx, streams);
+}
+
+std::vector<generate_result> generate_fan_out(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const std::vector<fan_out_branch> & branches,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids,
+    const std::atomic<bool> * cancel,
+    std::chrono::steady_clock::time_point deadline
+) {
+    std::vector<parallel_stream> streams;
+    streams.reserve(branches.size());
+    for (size_t i = 0; i < branches.size(); i++) {
+        const generate_params & params = branches[i].params;
+        llama_sampler * smpl = params.sampler ? clone_chain_with_seed(params.sampler, params.seed)
+                                              : build_sampler_chain(vocab, params);
+        streams.push_back(start_stream(ctx, params, smpl, src_seq, seq_ids[i], branches[i].prompt));
+        streams.back().option_tokens = branches[i].option_tokens;
+    }
+
+    run_streams(ctx, vocab, streams, cancel, deadline);
+    return finish_streams(ctx, streams);
+}
+
+struct beam_state {
+    llama_seq_id seq_id;
+    llama_sampler * smpl;
+    generate_result result;
+    double score;
+    llama_pos n_past;
+    int32_t logits_idx;
+};
+
+struct beam_candidate {
+    size_t parent;
+    llama_token token;
+    double score;
+};
+
+struct beam_hypothesis {
+    generate_result result;
+    double score;
+};
+
+static bool candidate_better(const beam_candidate & a, const beam_candidate & b) {
+    return a.score > b.score;
+}
+
+static bool logit_greater(const llama_token_data & a, const llama_token_data & b) {
+    return a.logit > b.logit;
+}
+
+// Mean token log probability, so longer hypotheses are not penalized for every token
+static double normalized_score(const beam_hypothesis & hyp) {
+    return hyp.score / std::max(1, hyp.result.tokens_generated);
+}
+
+generate_result generate_beam(
+    llama_context * ctx,
+    const struct llama_vocab * vocab,
+    const generate_params & params,
+    llama_seq_id src_seq,
+    const std::vector<llama_seq_id> & seq_ids
+) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    const llama_pos n_past = llama_memory_seq_pos_max(mem, src_seq) + 1;
+    const int32_t n_batch = llama_n_batch(ctx);
+    const size_t n_beams = seq_ids.size();
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    if (n_beams == 0) {
+        return generate_result();
+    }
+
+    llama_sampler * base = params.sampler;
+    if (!base) {
+        base = build_sampler_chain(vocab, params);
+    }
+
+    // Start from a single beam on src_seq's logits; the other sequences are free
+    std::vector<beam_state> beams(1);
+    beams[0].seq_id = seq_ids[0];
+    beams[0].smpl = clone_constraint_chain(base);
+    beams[0].score = 0.0;
+    beams[0].n_past = n_past;
+    beams[0].logits_idx = -1;
+    llama_memory_seq_rm(mem, seq_ids[0], -1, -1);
+    llama_memory_seq_cp(mem, src_seq, seq_ids[0], -1, -1);
+    std::vector<llama_seq_id> free_seqs(seq_ids.begin() + 1, seq_ids.end());
+
+    if (!params.sampler) {
+        llama_sampler_free(base);
+    }
+
+    std::vector<beam_hypothesis> finished;
+    std::vector<beam_candidate> candidates;
+    std::vector<beam_candidate> children;
+    std::vector<generate_result> child_results;
+    std::vector<llama_token_data> cur(n_vocab);
+    llama_batch batch = llama_batch_init(std::max<int32_t>(n_batch, n_beams), 0, 1);
+    stop_reason interrupted = STOP_NONE;
+
+    for (int step = 0; step < params.max_tokens; step++) {
+        // Top n_beams continuations of every beam under its own constraint state
+        candidates.clear();
+        for (size_t b = 0; b < beams.size(); b++) {
+            const float * logits = llama_get_logits_ith(ctx, beams[b].logits_idx);
+            for (llama_token id = 0; id < n_vocab; id++) {
+                cur[id] = { id, logits[id], 0.0f };
+            }
+            llama_token_data_array arr = { cur.data(), (size_t) n_vocab, -1, false };
+            llama_sampler_apply(beams[b].smpl, &arr);
+
+            float max_logit = -INFINITY;
+            for (size_t k = 0; k < arr.size; k++) {
+                max_logit = std::max(max_logit, arr.data[k].logit);
+            }
+            if (max_logit == -INFINITY) {
+                continue;
+            }
+            double sum = 0.0;
+            for (size_t k = 0; k < arr.size; k++) {
+                sum += std::exp(arr.data[k].logit - max_logit);
+            }
+            const double log_norm = max_logit + std::log(sum);
+
+            size_t top = std::min(n_beams, arr.size);
+            std::partial_sort(arr.data, arr.data + top, arr.data + arr.size, logit_greater);
+            for (size_t k = 0; k < top && arr.data[k].logit != -INFINITY; k++) {
+                beam_candidate candidate = { b, arr.data[k].id, beams[b].score + arr.data[k].logit - log_norm };
+                candidates.push_back(candidate);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), candidate_better);
+
+        // Fill up to n_beams live children; EOG and stop sequences complete a hypothesis
+        children.clear();
+        child_results.clear();
+        for (size_t c = 0; c < candidates.size() && children.size() < n_beams; c++) {
+            const beam_candidate & candidate = candidates[c];
+            const beam_state & parent = beams[candidate.parent];
+
+            generate_result result = parent.result;
+            token_status status = take_token(vocab, params, result, candidate.token);
+            if (status == TOKEN_EMPTY) {
+                continue;
+            }
+            if (status == TOKEN_END) {
+                beam_hypothesis hyp = { result, candidate.score };
+                finished.push_back(hyp);
+                continue;
+            }
+            children.push_back(candidate);
+            child_results.push_back(result);
+        }
+
+        if (finished.size() >= n_beams || children.empty() || step + 1 == params.max_tokens) {
+            for (size_t k = 0; k < children.size(); k++) {
+                beam_hypothesis hyp = { child_results[k], children[k].score };
+                hyp.result.reason = step + 1 == params.max_tokens ? STOP_MAX_TOKENS : STOP_NONE;
+                finished.push_back(hyp);
+            }
+            break;
+        }
+
+        // The first child of a parent continues its sequence and chain. Further children take
+        // the sequences of parents without children and share the parent's KV cells via seq_cp.
+        std::vector<int> first_child(beams.size(), -1);
+        for (size_t k = 0; k < children.size(); k++) {
+            if (first_child[children[k].parent] < 0) {
+                first_child[children[k].parent] = (int) k;
+            }
+        }
+        for (size_t b = 0; b < beams.size(); b++) {
+            if (first_child[b] < 0) {
+                llama_sampler_free(beams[b].smpl);
+                free_seqs.push_back(beams[b].seq_id);
+            }
+        }
+
+        // Split before any child accepts its token, while the parent chains are unchanged
+        std::vector<beam_state> next(children.size());
+        for (size_t k = 0; k < children.size(); k++) {
+            const beam_state & parent = beams[children[k].parent];
+            beam_state & child = next[k];
+            if (first_child[children[k].parent] == (int) k) {
+                child.seq_id = parent.seq_id;
+                child.smpl = parent.smpl;
+            } else {
+                child.seq_id = free_seqs.back();
+                free_seqs.pop_back();
+                llama_memory_seq_rm(mem, child.seq_id, -1, -1);
+                llama_memory_seq_cp(mem, parent.seq_id, child.seq_id, -1, -1);
+                child.smpl = llama_sampler_clone(parent.smpl);
+            }
+            std::swap(child.result, child_results[k]);
+            child.score = children[k].score;
+            child.n_past = parent.n_past;
+        }
+
+        // One batch advances every beam
+        batch.n_tokens = 0;
+        for (size_t k = 0; k < next.size(); k++) {
+            beam_state & child = next[k];
+            llama_sampler_accept(child.smpl, children[k].token);
+            child.logits_idx = batch.n_tokens;
+            batch_add(batch, children[k].token, child.n_past++, child.seq_id, true);
+        }
+        beams.swap(next);
+
+        interrupted = check_interrupt(params.cancel, params.deadline);
+        if (interrupted == STOP_NONE && llama_decode(ctx, batch) != 0) {
+            std::cerr << "Failed to decode batch" << std::endl;
+            interrupted = STOP_ERROR;
+        }
+        if (interrupted != STOP_NONE) {
+            for (auto & beam : beams) {
+                beam_hypothesis hyp = { beam.result, beam.score };
+                finished.push_back(hyp);
+            }
+            break;
+        }
+    }
+
+    for (auto & beam : beams) {
+        llama_sampler_free(beam.smpl);
+    }
+    for (llama_seq_id seq_id : seq_ids) {
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+    }
+
+    generate_result best;
+    double best_score = -INFINITY;
+    for (auto & hyp : finished) {
+        double score = normalized_score(hyp);
+        if (score > best_score) {
+            best_score = score;
+            std::swap(best, hyp.result);
+        }
+    }
+    if (interrupted != STOP_NONE) {
+        best.reason = interrupted;
+    }
+
+    // Finished beams may have lost their sequence, so the winner is decoded into src_seq
+    // again in one pass. As in generate(), a token completing a stop sequence is not decoded.
+    size_t n_decode = best.tokens.size() - (best.stopped_by_sequence ? 1 : 0);
+    for (size_t start = 0; start < n_decode; start += n_batch) {
+        size_t n = std::min<size_t>(n_batch, n_decode - start);
+        batch.n_tokens = 0;
+        for (size_t k = 0; k < n; k++) {
+            batch_add(batch, best.tokens[start + k], n_past + start + k, src_seq, start + k + 1 == n_decode);
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            std::cerr << "Failed to decode batch" << std::endl;
+            break;
+        }
+    }
+
+    llama_batch_free(batch);
+    return best;
 }
 
 llama_sampler * select_sampler(
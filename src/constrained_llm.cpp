@@ -1,123 +1,1504 @@
 #include "constrained_llm.h"
 #include "constrained_generation.h"
+#include "prompt_program.h"
 #include "llama.h"
 #include <iostream>
 #include <sstream>
+#include <cmath>
 #include <map>
+#include <tuple>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <thread>
+
+// Bounds for the per-session compile caches and sampler chain pool
+static const size_t MAX_COMPILED_CACHE = 64;
+static const size_t MAX_POOLED_CHAINS = 32;
+
+// Sequence 0 holds the first session's context; the others are used for forked sessions
+// and parallel streams
+static const int DEFAULT_MAX_SEQUENCES = 16;
+
+// Size of the chunks session text is stored in, the unit the output retention drops
+static const size_t TRANSCRIPT_CHUNK = 4096;
+
+// Default budget of a model's tokenization cache
+static const size_t DEFAULT_TOKEN_CACHE_BYTES = 1 << 20;
+
+// Keeps the llama.cpp backend initialized while any holder is alive
+struct backend_guard {
+    static std::mutex & mutex() {
+        static std::mutex m;
+        return m;
+    }
+    static int & users() {
+        static int n = 0;
+        return n;
+    }
+
+    backend_guard() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (users()++ == 0) {
+            llama_backend_init();
+        }
+    }
+    ~backend_guard() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (--users() == 0) {
+            llama_backend_free();
+        }
+    }
+
+    backend_guard(const backend_guard &) = delete;
+    backend_guard & operator=(const backend_guard &) = delete;
+};
+
+// LRU map from (add_special, text) to token ids, bounded by the bytes its entries hold
+class token_cache {
+public:
+    bool find(const std::string & key, std::vector<llama_token> & tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        tokens = it->second->tokens;
+        return true;
+    }
+
+    void insert(const std::string & key, const std::vector<llama_token> & tokens) {
+        entry e;
+        e.key = key;
+        e.tokens = tokens;
+        std::lock_guard<std::mutex> lock(mutex);
+        // A large fragment would evict most of the short ones the cache is for
+        if (cost(e) > max_bytes / 8 || index.count(key)) {
+            return;
+        }
+        entries.push_front(e);
+        index[key] = entries.begin();
+        bytes += cost(e);
+        evict();
+    }
+
+    void set_limit(size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_bytes = limit;
+        evict();
+    }
+
+    TokenCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        TokenCacheStats result;
+        result.hits = hits;
+        result.misses = misses;
+        result.entries = entries.size();
+        result.bytes = bytes;
+        result.max_bytes = max_bytes;
+        return result;
+    }
+
+private:
+    struct entry {
+        std::string key;
+        std::vector<llama_token> tokens;
+    };
+
+    // The key is held by the list and the index
+    static size_t cost(const entry & e) {
+        return 2 * e.key.size() + e.tokens.size() * sizeof(llama_token) + 64;
+    }
+
+    void evict() {
+        while (bytes > max_bytes && !entries.empty()) {
+            bytes -= cost(entries.back());
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    std::mutex mutex;
+    std::list<entry> entries;   // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    size_t max_bytes = DEFAULT_TOKEN_CACHE_BYTES;
+    size_t bytes = 0;
+    long hits = 0;
+    long misses = 0;
+};
+
+struct ModelHandle::Data {
+    backend_guard backend;
+    std::string path;
+    llama_model * model = nullptr;
+    token_cache tokens;
+
+    ~Data() {
+        if (model) llama_model_free(model);
+    }
+};
+
+ModelHandle ModelHandle::load(const std::string & model_path, const SessionConfig & config) {
+    typedef std::tuple<std::string, bool, bool> model_key;
+    static std::mutex registry_mutex;
+    static std::map<model_key, std::weak_ptr<Data>> registry;
+    static bool numa_initialized = false;
+
+    // Loading under the lock keeps concurrent requests for one file from loading it twice
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    model_key key(model_path, config.use_mmap, config.use_mlock);
+    std::shared_ptr<Data> data = registry[key].lock();
+    if (data) {
+        return ModelHandle(data);
+    }
+
+    if (config.quiet) {
+        llama_log_set(nullptr, nullptr);
+    }
+    data = std::make_shared<Data>();
+    if (config.numa != NUMA_DISABLED && !numa_initialized) {
+        llama_numa_init((ggml_numa_strategy) config.numa);
+        numa_initialized = true;
+    }
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = config.use_mmap;
+    model_params.use_mlock = config.use_mlock;
+    data->model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (!data->model) {
+        throw std::runtime_error("Failed to load model from: " + model_path);
+    }
+    data->path = model_path;
+
+    // Drop entries of models freed since
+    for (auto it = registry.begin(); it != registry.end();) {
+        if (it->second.expired()) {
+            it = registry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    registry[key] = data;
+    return ModelHandle(data);
+}
+
+llama_model * ModelHandle::get() const {
+    return data ? data->model : nullptr;
+}
+
+const std::string & ModelHandle::path() const {
+    static const std::string none;
+    return data ? data->path : none;
+}
+
+std::vector<llama_token> ModelHandle::tokenize(const std::string & text, bool add_special) const {
+    if (!data) {
+        throw std::runtime_error("tokenize() called on an empty ModelHandle");
+    }
+    std::string key(1, add_special ? '1' : '0');
+    key += text;
+    std::vector<llama_token> tokens;
+    if (data->tokens.find(key, tokens)) {
+        return tokens;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(data->model);
+    tokens.resize(text.size() + 16);
+    int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, false);
+    }
+    if (n < 0) {
+        throw std::runtime_error("Failed to tokenize text");
+    }
+    tokens.resize(n);
+    data->tokens.insert(key, tokens);
+    return tokens;
+}
+
+void ModelHandle::set_token_cache_limit(size_t max_bytes) const {
+    if (data) {
+        data->tokens.set_limit(max_bytes);
+    }
+}
+
+TokenCacheStats ModelHandle::token_cache_stats() const {
+    return data ? data->tokens.stats() : TokenCacheStats();
+}
+
+// Runs tasks in order on its own thread; pending tasks are run before it stops
+class task_queue {
+public:
+    task_queue() : worker(&task_queue::run, this) {}
+
+    // A task cannot join its own thread, so from one the queue is left to the worker, which
+    // deletes it after the remaining tasks
+    static void stop(std::unique_ptr<task_queue> queue) {
+        if (!queue || !queue->on_worker()) {
+            return;
+        }
+        task_queue * self = queue.release();
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->stopping = true;
+        self->detached = true;
+    }
+
+    ~task_queue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void push(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        ready.notify_one();
+    }
+
+    bool on_worker() const {
+        return std::this_thread::get_id() == worker.get_id();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    bool detached = false;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                if (detached) {
+                    lock.unlock();
+                    worker.detach();
+                    delete this;
+                }
+                return;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+};
+
+// Session text stored in chunks at offsets that stay valid as it grows: the context shift
+// removes spans from the middle and the retention limit drops chunks from the front without
+// moving the rest. Positions in the text of the context (what its tokens detokenize to) map
+// to offsets through the spans still in the context, which are tracked even when retention
+// no longer stores their text.
+class transcript {
+public:
+    size_t end() const { return end_offset; }
+    size_t size() const { return n_stored; }
+
+    void clear() {
+        chunks.clear();
+        live.clear();
+        end_offset = 0;
+        n_stored = 0;
+    }
+
+    void assign(const std::string & text) {
+        clear();
+        append(text);
+    }
+
+    void append(const std::string & text) {
+        if (text.empty()) {
+            return;
+        }
+        if (!live.empty() && live.back().second == end_offset) {
+            live.back().second += text.size();
+        } else {
+            live.push_back(std::make_pair(end_offset, end_offset + text.size()));
+        }
+
+        size_t done = 0;
+        if (!chunks.empty() && chunks.back().offset + chunks.back().text.size() == end_offset) {
+            std::string & last = chunks.back().text;
+            done = std::min(text.size(), TRANSCRIPT_CHUNK - std::min(last.size(), TRANSCRIPT_CHUNK));
+            last.append(text, 0, done);
+        }
+        while (done < text.size()) {
+            size_t n = std::min(TRANSCRIPT_CHUNK, text.size() - done);
+            chunks.push_back(chunk());
+            chunks.back().offset = end_offset + done;
+            chunks.back().text.assign(text, done, n);
+            done += n;
+        }
+        end_offset += text.size();
+        n_stored += text.size();
+        drop_old();
+    }
+
+    // Stores at least the last max_bytes of text, dropping whole chunks before them; 0 keeps
+    // everything
+    void set_retention(size_t max_bytes) {
+        retention = max_bytes;
+        drop_old();
+    }
+
+    // Drops the text from offset on
+    void truncate(size_t offset) {
+        if (offset >= end_offset) {
+            return;
+        }
+        erase_stored(offset, end_offset);
+        while (!live.empty() && live.back().first >= offset) {
+            live.pop_back();
+        }
+        if (!live.empty()) {
+            live.back().second = std::min(live.back().second, offset);
+        }
+        end_offset = offset;
+    }
+
+    // Removes [from, to) of the context text
+    void remove(size_t from, size_t to) {
+        std::vector<std::pair<size_t, size_t>> kept;
+        size_t position = 0;
+        for (const auto & span : live) {
+            size_t length = span.second - span.first;
+            size_t a = span.first + std::min(length, from - std::min(from, position));
+            size_t b = span.first + std::min(length, to - std::min(to, position));
+            if (a > span.first) {
+                kept.push_back(std::make_pair(span.first, a));
+            }
+            if (b > a) {
+                erase_stored(a, b);
+            }
+            if (span.second > b) {
+                kept.push_back(std::make_pair(b, span.second));
+            }
+            position += length;
+        }
+        live.swap(kept);
+    }
+
+    // Whether the context text starts with prefix; text no longer stored is taken as matching
+    bool starts_with(const std::string & prefix) const {
+        size_t length = 0;
+        for (const auto & span : live) {
+            length += span.second - span.first;
+        }
+        if (length < prefix.size()) {
+            return false;
+        }
+        for (const auto & c : chunks) {
+            size_t position = context_position(c.offset);
+            if (position >= prefix.size()) {
+                break;
+            }
+            size_t n = std::min(c.text.size(), prefix.size() - position);
+            if (c.text.compare(0, n, prefix, position, n) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void read(size_t from, const std::function<void(const char * text, size_t length)> & visit) const {
+        for (const auto & c : chunks) {
+            size_t c_end = c.offset + c.text.size();
+            if (c_end <= from) {
+                continue;
+            }
+            size_t skip = from > c.offset ? from - c.offset : 0;
+            visit(c.text.data() + skip, c.text.size() - skip);
+        }
+    }
+
+    std::string str(size_t from = 0) const {
+        std::string text;
+        text.reserve(n_stored);
+        read(from, [&text](const char * data, size_t length) {
+            text.append(data, length);
+        });
+        return text;
+    }
+
+private:
+    struct chunk {
+        size_t offset;
+        std::string text;
+    };
+    std::deque<chunk> chunks;
+    // Offset ranges of the text still in the context, in order
+    std::vector<std::pair<size_t, size_t>> live;
+    size_t end_offset = 0;
+    size_t n_stored = 0;
+    size_t retention = 0;
+
+    void drop_old() {
+        while (retention > 0 && chunks.size() > 1 && n_stored - chunks.front().text.size() >= retention) {
+            n_stored -= chunks.front().text.size();
+            chunks.pop_front();
+        }
+    }
+
+    size_t context_position(size_t offset) const {
+        size_t position = 0;
+        for (const auto & span : live) {
+            if (offset < span.second) {
+                return position + (offset > span.first ? offset - span.first : 0);
+            }
+            position += span.second - span.first;
+        }
+        return position;
+    }
+
+    void erase_stored(size_t from, size_t to) {
+        for (size_t i = 0; i < chunks.size();) {
+            chunk & c = chunks[i];
+            size_t c_end = c.offset + c.text.size();
+            if (c_end <= from || c.offset >= to) {
+                i++;
+                continue;
+            }
+            if (c.offset < from && c_end > to) {
+                chunk right;
+                right.offset = to;
+                right.text = c.text.substr(to - c.offset);
+                c.text.resize(from - c.offset);
+                n_stored -= to - from;
+                chunks.insert(chunks.begin() + i + 1, right);
+                return;
+            }
+            if (c.offset < from) {
+                n_stored -= c_end - from;
+                c.text.resize(from - c.offset);
+                i++;
+            } else if (c_end > to) {
+                n_stored -= to - c.offset;
+                c.text.erase(0, to - c.offset);
+                c.offset = to;
+                i++;
+            } else {
+                n_stored -= c.text.size();
+                chunks.erase(chunks.begin() + i);
+            }
+        }
+    }
+};
+
+// Model, context and draft shared by a session and the sessions forked from it
+struct shared_context {
+    ModelHandle model;
+    llama_context * ctx = nullptr;
+    std::vector<bool> seq_in_use;
+    // Sequence whose last token the current logits belong to
+    llama_seq_id logits_seq = -1;
+
+    ModelHandle draft_model;
+    llama_context * draft_ctx = nullptr;
+    std::vector<llama_token> draft_tokens;
+    int n_draft = 0;
+
+    // Runs the *_async calls of all sessions on the context
+    std::unique_ptr<task_queue> executor;
+    std::mutex async_mutex;
+    std::condition_variable async_idle;
+    int async_pending = 0;
+
+    ~shared_context() {
+        task_queue::stop(std::move(executor));
+        if (draft_ctx) llama_free(draft_ctx);
+        if (ctx) llama_free(ctx);
+    }
+};
 
 struct LLMSession::Impl {
+    typedef std::tuple<const void *, const void *, float, uint32_t> chain_key;
+
+    std::shared_ptr<shared_context> shared;
+    // Session the async calls run on; replaced when it is destroyed from a done callback
+    LLMSession * owner = nullptr;
+    llama_seq_id seq_id = 0;
     llama_model * model = nullptr;
     llama_context * ctx = nullptr;
     const llama_vocab * vocab = nullptr;
-    std::string accumulated_text;
+    SessionConfig config;
+    transcript accumulated_text;
     std::vector<llama_token> context_tokens;
     std::map<std::string, std::string> variables;
     bool auto_cache_enabled = false;
-    std::vector<uint8_t> cached_prompt_data;
+    bool logprobs_enabled = false;
+    bool lazy_prefill = false;
+    // Context shift settings; shift_sink is -1 while it is disabled
+    int shift_sink = -1;
+    int shift_discard = 0;
+    // Set by make_room when a shift was needed but forks share the context
+    bool shift_blocked = false;
+    std::shared_ptr<const std::vector<uint8_t>> cached_prompt_data;
     bool has_cached = false;
 
+    std::map<std::vector<std::string>, CompiledOptions> options_cache;
+    std::map<std::vector<std::string>, CompiledStops> stops_cache;
+    std::map<std::tuple<int, std::string, std::vector<std::string>>, CompiledPattern> pattern_cache;
+    std::map<std::string, CompiledProgram> program_cache;
+    std::map<chain_key, llama_sampler *> sampler_pool;
+
+    std::vector<llama_token> draft_history;
+    GenerationStats last_stats;
+
+    CancelToken cancel_token;
+    std::function<bool(const PrefillProgress &)> prefill_callback;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Set when the last decode of this session was not its last token (parallel streams,
+    // rolled back prompts); decodes by other sessions are tracked by shared->logits_seq
+    bool logits_stale = false;
+    // Tokens at the end of context_tokens that are not in the KV cache yet. A program run
+    // leaves the last tokens of a hole and the literal text after it here (defer_decode), so
+    // they are evaluated together in the next prefill batch.
+    size_t n_undecoded = 0;
+    bool defer_decode = false;
+
     ~Impl() {
-        if (ctx) llama_free(ctx);
-        if (model) llama_model_free(model);
-        llama_backend_free();
+        free_sampler_pool();
+        if (shared && shared->ctx) {
+            llama_memory_seq_rm(llama_get_memory(shared->ctx), seq_id, -1, -1);
+            if (seq_id != 0) {
+                release_sequences(std::vector<llama_seq_id>(1, seq_id));
+            }
+            if (shared->logits_seq == seq_id) {
+                shared->logits_seq = -1;
+            }
+        }
+    }
+
+    // Queues call on the context's executor; its result or exception completes the future
+    template <typename T>
+    std::future<T> run_async(std::function<std::string(LLMSession & session)> call, AsyncCallback done) {
+        if (!shared->executor) {
+            shared->executor.reset(new task_queue());
+        }
+        std::shared_ptr<std::promise<T>> promise = std::make_shared<std::promise<T>>();
+        std::future<T> future = promise->get_future();
+        std::shared_ptr<shared_context> context = shared;
+        {
+            std::lock_guard<std::mutex> lock(context->async_mutex);
+            context->async_pending++;
+        }
+        shared->executor->push([this, context, call, done, promise] {
+            std::string result;
+            std::exception_ptr error;
+            try {
+                result = call(*owner);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (done) {
+                try {
+                    done(result, error);
+                } catch (...) {
+                    if (!error) error = std::current_exception();
+                }
+            }
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                set_result(*promise, result);
+            }
+
+            std::lock_guard<std::mutex> lock(context->async_mutex);
+            if (--context->async_pending == 0) {
+                context->async_idle.notify_all();
+            }
+        });
+        return future;
+    }
+
+    static void set_result(std::promise<std::string> & promise, const std::string & result) {
+        promise.set_value(result);
     }
 
-    void encode_and_eval(const std::string & text) {
-        std::vector<llama_token> tokens(text.size() + 16);
-        int n = llama_tokenize(vocab, text.c_str(), text.size(),
-                               tokens.data(), tokens.size(),
-                               context_tokens.empty(), false);
-        tokens.resize(n);
+    static void set_result(std::promise<void> & promise, const std::string &) {
+        promise.set_value();
+    }
+
+    bool on_executor() const {
+        return shared->executor && shared->executor->on_worker();
+    }
 
-        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
-            throw std::runtime_error("Failed to decode text");
+    // Waits for the async calls of every session on the context, which would otherwise use
+    // it concurrently. On the executor they are serialized already.
+    void wait_async() const {
+        if (on_executor()) {
+            return;
         }
+        std::unique_lock<std::mutex> lock(shared->async_mutex);
+        shared->async_idle.wait(lock, [this] { return shared->async_pending == 0; });
+    }
 
+    stop_reason interrupted() const {
+        return check_interrupt(cancel_token.get(), deadline);
+    }
+
+    std::vector<llama_token> tokenize(const std::string & text, bool add_special) const {
+        return shared->model.tokenize(text, add_special);
+    }
+
+    std::string detokenize(const std::vector<llama_token> & tokens, size_t n_tokens = -1, bool unparse_special = false) const {
+        n_tokens = std::min(n_tokens, tokens.size());
+        std::string text(n_tokens * 4 + 16, '\0');
+        int n = llama_detokenize(vocab, tokens.data(), n_tokens, &text[0], text.size(), true, unparse_special);
+        if (n < 0) {
+            text.resize(-n);
+            n = llama_detokenize(vocab, tokens.data(), n_tokens, &text[0], text.size(), true, unparse_special);
+        }
+        text.resize(std::max(n, 0));
+        return text;
+    }
+
+    stop_reason encode_and_eval(const std::string & text) {
+        std::vector<llama_token> tokens = tokenize(text, context_tokens.empty());
+        if (defer_decode || lazy_prefill) {
+            append_undecoded(tokens);
+            return STOP_NONE;
+        }
+        ensure_room(tokens.size());
+        return eval_tokens(tokens);
+    }
+
+    void append_undecoded(const std::vector<llama_token> & tokens) {
         context_tokens.insert(context_tokens.end(), tokens.begin(), tokens.end());
+        n_undecoded += tokens.size();
+    }
+
+    // Evaluates the undecoded tokens. Their text is already part of the session, so when
+    // interruptible is false the call limits are not checked.
+    stop_reason flush(bool interruptible) {
+        if (n_undecoded == 0) {
+            return STOP_NONE;
+        }
+        ensure_room(0);
+        return eval_tokens(std::vector<llama_token>(), interruptible);
+    }
+
+    // Context shift: if n_tokens more positions would not fit, drops tokens after the first
+    // shift_sink from the sequence and moves the rest back so positions stay contiguous.
+    // Only the first context_tokens.size() - n_protected tokens may be dropped; the caller's
+    // tokens in flight (decoded but not yet tracked) follow them in the cache.
+    void make_room(size_t n_tokens, size_t n_protected = 0) {
+        if (shift_sink < 0) {
+            return;
+        }
+        llama_memory_t mem = llama_get_memory(ctx);
+        const size_t n_ctx = llama_n_ctx(ctx);
+        const size_t n_past = llama_memory_seq_pos_max(mem, seq_id) + 1;
+        n_tokens += n_undecoded;
+        if (n_past + n_tokens <= n_ctx) {
+            return;
+        }
+        // Cells shared with forks carry their positions too; moving them would corrupt the forks
+        if (std::count(shared->seq_in_use.begin(), shared->seq_in_use.end(), true) > 1) {
+            shift_blocked = true;
+            return;
+        }
+
+        // Undecoded tokens are not in the cache yet and stay as well
+        const size_t n_text = context_tokens.size() - std::min(n_protected, context_tokens.size());
+        const size_t n_limit = n_text - std::min(n_undecoded, n_text);
+        const size_t n_sink = shift_sink;
+        if (n_limit <= n_sink) {
+            return;
+        }
+        size_t n_discard = shift_discard > 0 ? (size_t) shift_discard : (n_past - n_sink) / 2;
+        n_discard = std::max(n_discard, n_past + n_tokens - n_ctx);
+        n_discard = std::min(n_discard, n_limit - n_sink);
+        const size_t n_end = n_sink + n_discard;
+
+        // The text of the kept sinks and of everything up to the end of the dropped span, to
+        // find the same span in the text
+        std::string sink_text = detokenize(context_tokens, n_sink, true);
+        std::string dropped_text = detokenize(context_tokens, n_end, true);
+
+        llama_memory_seq_rm(mem, seq_id, n_sink, n_end);
+        llama_memory_seq_add(mem, seq_id, n_end, -1, -(llama_pos) n_discard);
+
+        if (shared->draft_ctx) {
+            // The draft holds the same tokens if this session drafted last; otherwise
+            // sync_draft re-evaluates it from the first difference
+            std::vector<llama_token> & draft_tokens = shared->draft_tokens;
+            llama_memory_t draft_mem = llama_get_memory(shared->draft_ctx);
+            if (draft_tokens.size() >= n_end && llama_memory_can_shift(draft_mem) &&
+                std::equal(context_tokens.begin(), context_tokens.begin() + n_end, draft_tokens.begin())) {
+                llama_memory_seq_rm(draft_mem, 0, n_sink, n_end);
+                llama_memory_seq_add(draft_mem, 0, n_end, -1, -(llama_pos) n_discard);
+                draft_tokens.erase(draft_tokens.begin() + n_sink, draft_tokens.begin() + n_end);
+            }
+        }
+
+        context_tokens.erase(context_tokens.begin() + n_sink, context_tokens.begin() + n_end);
+        if (accumulated_text.starts_with(dropped_text) && dropped_text.compare(0, sink_text.size(), sink_text) == 0) {
+            accumulated_text.remove(sink_text.size(), dropped_text.size());
+        } else {
+            accumulated_text.assign(detokenize(context_tokens, n_text - n_discard, true));
+        }
+        last_stats.tokens_discarded += n_discard;
+    }
+
+    // make_room for calls that have not decoded anything yet: throws instead of letting the
+    // decode fail when the shift is blocked
+    void ensure_room(size_t n_tokens) {
+        make_room(n_tokens);
+        throw_if_shift_blocked();
+    }
+
+    void throw_if_shift_blocked() {
+        if (shift_blocked) {
+            shift_blocked = false;
+            throw std::runtime_error("Context is full and context shift is unavailable while forked sessions share it");
+        }
+    }
+
+    // Evaluates tokens in n_ubatch chunks with logits for the final token only, checking the
+    // call limits and reporting progress between chunks. If interrupted, the chunks already
+    // decoded are removed again and the reason is returned. Undecoded tokens go first in the
+    // same batches; if interrupted they stay undecoded.
+    stop_reason eval_tokens(const std::vector<llama_token> & tokens, bool interruptible = true) {
+        if (n_undecoded > 0) {
+            std::vector<llama_token> all(context_tokens.end() - n_undecoded, context_tokens.end());
+            all.insert(all.end(), tokens.begin(), tokens.end());
+            const size_t n_pending = n_undecoded;
+            context_tokens.resize(context_tokens.size() - n_pending);
+            n_undecoded = 0;
+            stop_reason reason;
+            try {
+                reason = eval_tokens(all, interruptible);
+            } catch (...) {
+                append_undecoded(std::vector<llama_token>(all.begin(), all.begin() + n_pending));
+                throw;
+            }
+            if (reason != STOP_NONE) {
+                append_undecoded(std::vector<llama_token>(all.begin(), all.begin() + n_pending));
+            }
+            return reason;
+        }
+        if (tokens.empty()) {
+            return STOP_NONE;
+        }
+
+        llama_memory_t mem = llama_get_memory(ctx);
+        const llama_pos n_past = llama_memory_seq_pos_max(mem, seq_id) + 1;
+        const size_t n_chunk = std::min<size_t>(llama_n_ubatch(ctx), tokens.size());
+        llama_batch batch = llama_batch_init(n_chunk, 0, 1);
+
+        PrefillProgress progress;
+        progress.tokens_total = tokens.size();
+
+        stop_reason reason = STOP_NONE;
+        bool failed = false;
+        size_t start = 0;
+        while (start < tokens.size()) {
+            reason = interruptible ? interrupted() : STOP_NONE;
+            if (reason != STOP_NONE) {
+                break;
+            }
+
+            size_t n = std::min(n_chunk, tokens.size() - start);
+            batch.n_tokens = n;
+            for (size_t k = 0; k < n; k++) {
+                batch.token[k] = tokens[start + k];
+                batch.pos[k] = n_past + start + k;
+                batch.n_seq_id[k] = 1;
+                batch.seq_id[k][0] = seq_id;
+                batch.logits[k] = start + k + 1 == tokens.size();
+            }
+
+            std::chrono::steady_clock::time_point chunk_start = std::chrono::steady_clock::now();
+            if (llama_decode(ctx, batch) != 0) {
+                failed = true;
+                break;
+            }
+            start += n;
+
+            if (prefill_callback) {
+                progress.tokens_done = start;
+                progress.chunk_tokens = n;
+                progress.chunk_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - chunk_start).count();
+                if (!prefill_callback(progress) && interruptible && start < tokens.size()) {
+                    reason = STOP_CALLBACK;
+                    break;
+                }
+            }
+        }
+        llama_batch_free(batch);
+
+        if (reason != STOP_NONE || failed) {
+            if (start > 0) {
+                llama_memory_seq_rm(mem, seq_id, n_past, -1);
+                logits_stale = true;
+            }
+            if (failed) {
+                throw std::runtime_error("Failed to decode text");
+            }
+            return reason;
+        }
+
+        context_tokens.insert(context_tokens.end(), tokens.begin(), tokens.end());
+        logits_stale = false;
+        shared->logits_seq = seq_id;
+        return STOP_NONE;
+    }
+
+    // Re-evaluates the session's last token after other sequences were decoded,
+    // so the context logits belong to the session again
+    void refresh_logits() {
+        logits_stale = false;
+        shared->logits_seq = seq_id;
+        if (context_tokens.empty()) {
+            return;
+        }
+
+        llama_memory_t mem = llama_get_memory(ctx);
+        llama_pos last = llama_memory_seq_pos_max(mem, seq_id);
+        if (last < 0) {
+            return;
+        }
+
+        llama_memory_seq_rm(mem, seq_id, last, -1);
+        std::vector<llama_token> token(1, context_tokens.back());
+        if (!decode_tokens(ctx, token, seq_id)) {
+            throw std::runtime_error("Failed to decode token");
+        }
+    }
+
+    void ensure_logits() {
+        flush(false);
+        if (logits_stale || shared->logits_seq != seq_id) {
+            refresh_logits();
+        }
+    }
+
+    // Length of the common prefix of tokens and context_tokens
+    size_t common_prefix(const std::vector<llama_token> & tokens) const {
+        size_t n = 0;
+        while (n < tokens.size() && n < context_tokens.size() && tokens[n] == context_tokens[n]) {
+            n++;
+        }
+        return n;
+    }
+
+    // Drops everything after the first n_keep tokens from sequence 0
+    void truncate(size_t n_keep) {
+        if (n_keep >= context_tokens.size()) {
+            return;
+        }
+        llama_memory_seq_rm(llama_get_memory(ctx), seq_id, n_keep, -1);
+        size_t n_decoded = context_tokens.size() - n_undecoded;
+        n_undecoded = n_keep > n_decoded ? n_keep - n_decoded : 0;
+        context_tokens.resize(n_keep);
+        logits_stale = true;
+    }
+
+    // A saved context whose tokens are a prefix of the current one is restored by truncating
+    // the KV cache instead of copying the saved state back
+    bool load_prefix(const std::vector<llama_token> & tokens) {
+        if (tokens.empty() || common_prefix(tokens) != tokens.size()) {
+            return false;
+        }
+        truncate(tokens.size());
+        ensure_logits();
+        return true;
+    }
+
+    // Makes tokens the whole context: the KV cache of the prefix shared with context_tokens is
+    // kept and only the rest is evaluated. If interrupted, the context is left at the prefix.
+    stop_reason reuse_prefix(const std::vector<llama_token> & tokens, size_t * n_reused) {
+        size_t n_keep = common_prefix(tokens);
+        truncate(n_keep);
+        *n_reused = n_keep;
+        if (n_keep == tokens.size()) {
+            ensure_logits();
+            return STOP_NONE;
+        }
+        return eval_tokens(std::vector<llama_token>(tokens.begin() + n_keep, tokens.end()));
+    }
+
+    const CompiledOptions & get_options(const std::vector<std::string> & options) {
+        auto it = options_cache.find(options);
+        if (it != options_cache.end()) {
+            return it->second;
+        }
+        if (options_cache.size() >= MAX_COMPILED_CACHE) {
+            options_cache.clear();
+        }
+        return options_cache[options] = CompiledOptions(vocab, options);
+    }
+
+    const CompiledStops & get_stops(const std::vector<std::string> & stop_sequences) {
+        auto it = stops_cache.find(stop_sequences);
+        if (it != stops_cache.end()) {
+            return it->second;
+        }
+        if (stops_cache.size() >= MAX_COMPILED_CACHE) {
+            stops_cache.clear();
+        }
+        return stops_cache[stop_sequences] = CompiledStops(vocab, stop_sequences);
+    }
+
+    const CompiledPattern & get_pattern(
+        PatternType pattern,
+        const std::string & regex_pattern,
+        const std::vector<std::string> & stop_sequences
+    ) {
+        auto key = std::make_tuple((int) pattern, regex_pattern, stop_sequences);
+        auto it = pattern_cache.find(key);
+        if (it != pattern_cache.end()) {
+            return it->second;
+        }
+        if (pattern_cache.size() >= MAX_COMPILED_CACHE) {
+            pattern_cache.clear();
+        }
+        return pattern_cache[key] = CompiledPattern(vocab, pattern, regex_pattern, stop_sequences);
+    }
+
+    // A handle compiled for another model's vocabulary would constrain the wrong token ids
+    void check_vocab(const llama_vocab * compiled_for, const std::string & what) const {
+        if (compiled_for != vocab) {
+            throw std::runtime_error(what + " was compiled for another model");
+        }
+    }
+
+    void check_vocab(const GenerateOptions & options) const {
+        if (!options.compiled_stops.empty()) {
+            check_vocab(options.compiled_stops.get().vocab, "CompiledStops");
+        }
+        if (!options.compiled_pattern.empty()) {
+            check_vocab(options.compiled_pattern.get().vocab, "CompiledPattern");
+        }
+    }
+
+    const CompiledProgram & get_program(const std::string & source) {
+        auto it = program_cache.find(source);
+        if (it != program_cache.end()) {
+            return it->second;
+        }
+        if (program_cache.size() >= MAX_COMPILED_CACHE) {
+            program_cache.clear();
+        }
+        CompiledProgram program(vocab, source);
+        return program_cache[source] = program;
+    }
+
+    // Pooled chains keep a reference to the compiled data they were built from,
+    // so the data addresses used as keys stay valid while the chain is pooled.
+    llama_sampler * find_pooled_chain(const chain_key & key) {
+        auto it = sampler_pool.find(key);
+        if (it == sampler_pool.end()) {
+            return nullptr;
+        }
+        llama_sampler_reset(it->second);
+        return it->second;
+    }
+
+    void add_pooled_chain(const chain_key & key, llama_sampler * smpl) {
+        if (sampler_pool.size() >= MAX_POOLED_CHAINS) {
+            free_sampler_pool();
+        }
+        sampler_pool[key] = smpl;
+    }
+
+    void free_sampler_pool() {
+        for (auto & entry : sampler_pool) {
+            llama_sampler_free(entry.second);
+        }
+        sampler_pool.clear();
+    }
+
+    llama_sampler * select_chain(const CompiledOptions & options) {
+        chain_key key(options.shared().get(), nullptr, 0.0f, 0);
+        llama_sampler * smpl = find_pooled_chain(key);
+        if (!smpl) {
+            auto sparams = llama_sampler_chain_default_params();
+            smpl = llama_sampler_chain_init(sparams);
+            llama_sampler_chain_add(smpl, llama_sampler_init_prefix_select(options));
+            llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.0f));
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+            add_pooled_chain(key, smpl);
+        }
+        return smpl;
+    }
+
+    llama_sampler * generate_chain(const CompiledPattern & pattern, const CompiledStops & stops, float temperature, uint32_t seed) {
+        chain_key key(pattern.shared().get(), stops.shared().get(), temperature, seed);
+        llama_sampler * smpl = find_pooled_chain(key);
+        if (!smpl) {
+            auto sparams = llama_sampler_chain_default_params();
+            smpl = llama_sampler_chain_init(sparams);
+            if (!pattern.empty()) {
+                llama_sampler_chain_add(smpl, llama_sampler_init_pattern(pattern));
+            }
+            if (!stops.empty()) {
+                llama_sampler_chain_add(smpl, llama_sampler_init_stop_sequence(stops));
+            }
+            llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+            add_pooled_chain(key, smpl);
+        }
+        return smpl;
+    }
+
+    // Brings the draft KV cache in line with tokens, keeping the common prefix, and leaves
+    // the draft logits at the last token
+    bool sync_draft(const std::vector<llama_token> & tokens) {
+        size_t n_keep = 0;
+        std::vector<llama_token> & draft_tokens = shared->draft_tokens;
+        while (n_keep < draft_tokens.size() && n_keep < tokens.size() && draft_tokens[n_keep] == tokens[n_keep]) {
+            n_keep++;
+        }
+        if (n_keep == tokens.size()) {
+            n_keep--;
+        }
+
+        llama_memory_seq_rm(llama_get_memory(shared->draft_ctx), 0, n_keep, -1);
+        draft_tokens.assign(tokens.begin(), tokens.end());
+
+        std::vector<llama_token> tail(tokens.begin() + n_keep, tokens.end());
+        if (!decode_tokens(shared->draft_ctx, tail)) {
+            llama_memory_seq_rm(llama_get_memory(shared->draft_ctx), 0, n_keep, -1);
+            draft_tokens.resize(n_keep);
+            return false;
+        }
+        return true;
+    }
+
+    void propose_draft(
+        const std::vector<llama_token> & generated,
+        const llama_sampler * smpl,
+        int n_max,
+        std::vector<llama_token> & draft
+    ) {
+        draft_history.assign(context_tokens.begin(), context_tokens.end());
+        draft_history.insert(draft_history.end(), generated.begin(), generated.end());
+        // A failed draft decode only disables speculation for this step
+        if (!sync_draft(draft_history)) {
+            return;
+        }
+
+        llama_sampler * chain = clone_constraint_chain(smpl);
+        for (int i = 0; i < n_max; i++) {
+            llama_token token = llama_sampler_sample(chain, shared->draft_ctx, -1);
+            if (llama_vocab_is_eog(vocab, token)) {
+                break;
+            }
+            draft.push_back(token);
+            if (i + 1 == n_max) {
+                break;
+            }
+            if (llama_decode(shared->draft_ctx, llama_batch_get_one(&token, 1)) != 0) {
+                break;
+            }
+            shared->draft_tokens.push_back(token);
+        }
+        llama_sampler_free(chain);
+    }
+
+    std::vector<llama_seq_id> acquire_sequences(int n) {
+        std::vector<bool> & seq_in_use = shared->seq_in_use;
+        std::vector<llama_seq_id> seq_ids;
+        for (size_t i = 1; i < seq_in_use.size() && (int) seq_ids.size() < n; i++) {
+            if (!seq_in_use[i]) {
+                seq_ids.push_back((llama_seq_id) i);
+            }
+        }
+        if ((int) seq_ids.size() < n) {
+            std::ostringstream msg;
+            msg << "Not enough free sequences: requested " << n << ", available " << seq_ids.size();
+            throw std::runtime_error(msg.str());
+        }
+        for (llama_seq_id id : seq_ids) {
+            seq_in_use[id] = true;
+        }
+        return seq_ids;
+    }
+
+    void release_sequences(const std::vector<llama_seq_id> & seq_ids) {
+        for (llama_seq_id id : seq_ids) {
+            shared->seq_in_use[id] = false;
+        }
     }
 };
 
-LLMSession::LLMSession(const std::string & model_path, int context_length, bool quiet)
-    : pImpl(new Impl()) {
+static const char * kv_cache_type_name(KVCacheType type) {
+    switch (type) {
+        case KV_CACHE_Q8_0: return "q8_0";
+        case KV_CACHE_Q4_0: return "q4_0";
+        default:            return "f16";
+    }
+}
 
-    if (quiet) {
-        llama_log_set(nullptr, nullptr);
+static ggml_type kv_cache_ggml_type(KVCacheType type) {
+    switch (type) {
+        case KV_CACHE_Q8_0: return GGML_TYPE_Q8_0;
+        case KV_CACHE_Q4_0: return GGML_TYPE_Q4_0;
+        default:            return GGML_TYPE_F16;
     }
+}
 
-    llama_backend_init();
+static llama_flash_attn_type flash_attn_type(FlashAttention flash_attn) {
+    switch (flash_attn) {
+        case FLASH_ATTN_ENABLED:  return LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        case FLASH_ATTN_DISABLED: return LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        default:                  return LLAMA_FLASH_ATTN_TYPE_AUTO;
+    }
+}
 
-    llama_model_params model_params = llama_model_default_params();
-    pImpl->model = llama_model_load_from_file(model_path.c_str(), model_params);
+static const char * flash_attn_name(FlashAttention flash_attn) {
+    switch (flash_attn) {
+        case FLASH_ATTN_ENABLED:  return "on";
+        case FLASH_ATTN_DISABLED: return "off";
+        default:                  return "auto";
+    }
+}
 
-    if (!pImpl->model) {
-        throw std::runtime_error("Failed to load model from: " + model_path);
+static const char * numa_name(NumaStrategy numa) {
+    switch (numa) {
+        case NUMA_DISTRIBUTE: return "distribute";
+        case NUMA_ISOLATE:    return "isolate";
+        case NUMA_NUMACTL:    return "numactl";
+        case NUMA_MIRROR:     return "mirror";
+        default:              return "disabled";
     }
+}
+
+static int default_n_batch(int context_length) {
+    return context_length > 2048 ? 2048 : context_length;
+}
+
+static void validate_config(const SessionConfig & config) {
+    if (config.context_length <= 0) {
+        throw std::runtime_error("SessionConfig: context_length must be positive");
+    }
+    if (config.n_batch < 0 || config.n_ubatch < 0 || config.n_threads < 0 || config.n_threads_batch < 0) {
+        throw std::runtime_error("SessionConfig: n_batch, n_ubatch and thread counts must not be negative");
+    }
+    int n_batch = config.n_batch > 0 ? config.n_batch : default_n_batch(config.context_length);
+    if (config.n_ubatch > n_batch) {
+        throw std::runtime_error("SessionConfig: n_ubatch (" + std::to_string(config.n_ubatch) +
+                                 ") exceeds n_batch (" + std::to_string(n_batch) + ")");
+    }
+    if (config.kv_cache_type != KV_CACHE_F16 && config.flash_attn == FLASH_ATTN_DISABLED) {
+        throw std::runtime_error(std::string("SessionConfig: a ") + kv_cache_type_name(config.kv_cache_type) +
+                                 " KV cache requires flash attention");
+    }
+}
+
+llama_context_params SessionConfig::context_params() const {
+    validate_config(*this);
 
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = context_length;
-    ctx_params.n_batch = context_length > 2048 ? 2048 : context_length;
+    ctx_params.n_batch = n_batch > 0 ? n_batch : default_n_batch(context_length);
+    if (n_ubatch > 0) {
+        ctx_params.n_ubatch = n_ubatch;
+    }
+    if (n_threads > 0) {
+        ctx_params.n_threads = n_threads;
+        ctx_params.n_threads_batch = n_threads;
+    }
+    if (n_threads_batch > 0) {
+        ctx_params.n_threads_batch = n_threads_batch;
+    }
+    ctx_params.flash_attn_type = flash_attn_type(flash_attn);
+    ctx_params.type_k = kv_cache_ggml_type(kv_cache_type);
+    ctx_params.type_v = kv_cache_ggml_type(kv_cache_type);
+    return ctx_params;
+}
+
+static SessionConfig make_config(int context_length, bool quiet) {
+    SessionConfig config;
+    config.context_length = context_length;
+    config.quiet = quiet;
+    return config;
+}
+
+// Validates before the model is loaded
+static const SessionConfig & validated(const SessionConfig & config) {
+    validate_config(config);
+    return config;
+}
+
+LLMSession::LLMSession(const std::string & model_path, int context_length, bool quiet)
+    : LLMSession(model_path, make_config(context_length, quiet)) {
+}
+
+LLMSession::LLMSession(const std::string & model_path, const SessionConfig & config)
+    : LLMSession(ModelHandle::load(model_path, validated(config)), config) {
+}
+
+LLMSession::LLMSession(const ModelHandle & model, const SessionConfig & config)
+    : pImpl(new Impl()) {
+    pImpl->owner = this;
+
+    llama_context_params ctx_params = config.context_params();
+    if (model.empty()) {
+        throw std::runtime_error("LLMSession created from an empty ModelHandle");
+    }
 
-    pImpl->ctx = llama_init_from_model(pImpl->model, ctx_params);
+    pImpl->shared = std::make_shared<shared_context>();
+    pImpl->shared->model = model;
+    pImpl->model = model.get();
+
+    // Forked sequences share the prompt cells, which requires a unified KV cache
+    ctx_params.n_seq_max = DEFAULT_MAX_SEQUENCES;
+    ctx_params.kv_unified = true;
+
+    pImpl->ctx = pImpl->shared->ctx = llama_init_from_model(pImpl->model, ctx_params);
     if (!pImpl->ctx) {
-        throw std::runtime_error("Failed to create context");
+        throw std::runtime_error(std::string("Failed to create context (") + kv_cache_type_name(config.kv_cache_type) +
+                                 " KV cache, flash attention " + flash_attn_name(config.flash_attn) + ")");
     }
 
+    pImpl->config = config;
+    pImpl->config.context_length = llama_n_ctx(pImpl->ctx);
+    pImpl->config.n_batch = llama_n_batch(pImpl->ctx);
+    pImpl->config.n_ubatch = llama_n_ubatch(pImpl->ctx);
+    pImpl->config.n_threads = llama_n_threads(pImpl->ctx);
+    pImpl->config.n_threads_batch = llama_n_threads_batch(pImpl->ctx);
+
+    pImpl->shared->seq_in_use.assign(llama_n_seq_max(pImpl->ctx), false);
+    pImpl->shared->seq_in_use[0] = true;
+
     pImpl->vocab = llama_model_get_vocab(pImpl->model);
 }
 
-LLMSession::~LLMSession() = default;
+ModelHandle LLMSession::get_model() const {
+    return pImpl->shared->model;
+}
+
+LLMSession::LLMSession(std::unique_ptr<Impl> impl)
+    : pImpl(std::move(impl)) {
+    pImpl->owner = this;
+}
+
+LLMSession::~LLMSession() {
+    if (!pImpl) {
+        return;
+    }
+    if (pImpl->on_executor()) {
+        // Destroyed from a done callback: the running call and any queued after it still
+        // use the session, so they continue on a session that a task behind them deletes
+        LLMSession * orphan = new LLMSession(std::move(pImpl));
+        orphan->pImpl->shared->executor->push([orphan] {
+            std::unique_ptr<Impl> impl = std::move(orphan->pImpl);
+            delete orphan;
+        });
+        return;
+    }
+    pImpl->wait_async();
+}
+
+std::unique_ptr<LLMSession> LLMSession::fork() const {
+    pImpl->wait_async();
+    // Buffered text is evaluated once into the shared cells rather than by every branch
+    pImpl->flush(false);
+    std::unique_ptr<Impl> child(new Impl());
+    child->shared = pImpl->shared;
+    child->seq_id = pImpl->acquire_sequences(1)[0];
+    child->model = pImpl->model;
+    child->ctx = pImpl->ctx;
+    child->vocab = pImpl->vocab;
+
+    // Cells of the parent's sequence are tagged with the child's as well, not copied
+    llama_memory_t mem = llama_get_memory(pImpl->ctx);
+    llama_memory_seq_rm(mem, child->seq_id, -1, -1);
+    llama_memory_seq_cp(mem, pImpl->seq_id, child->seq_id, -1, -1);
+
+    child->config = pImpl->config;
+    child->accumulated_text = pImpl->accumulated_text;
+    child->context_tokens = pImpl->context_tokens;
+    child->n_undecoded = pImpl->n_undecoded;
+    child->variables = pImpl->variables;
+    child->auto_cache_enabled = pImpl->auto_cache_enabled;
+    child->logprobs_enabled = pImpl->logprobs_enabled;
+    child->lazy_prefill = pImpl->lazy_prefill;
+    child->shift_sink = pImpl->shift_sink;
+    child->shift_discard = pImpl->shift_discard;
+    child->cached_prompt_data = pImpl->cached_prompt_data;
+    child->has_cached = pImpl->has_cached;
+    child->options_cache = pImpl->options_cache;
+    child->stops_cache = pImpl->stops_cache;
+    child->pattern_cache = pImpl->pattern_cache;
+    child->program_cache = pImpl->program_cache;
+    child->cancel_token = pImpl->cancel_token;
+    child->prefill_callback = pImpl->prefill_callback;
+    child->deadline = pImpl->deadline;
+    child->logits_stale = true;
+
+    return std::unique_ptr<LLMSession>(new LLMSession(std::move(child)));
+}
+
+// Drafted tokens are verified by id, so both models must map ids to the same text: equal
+// sizes and special tokens, and equal pieces for ids sampled across the vocabulary
+static bool same_vocab(const llama_vocab * a, const llama_vocab * b) {
+    const int32_t n_tokens = llama_vocab_n_tokens(a);
+    if (llama_vocab_n_tokens(b) != n_tokens ||
+        llama_vocab_bos(a) != llama_vocab_bos(b) ||
+        llama_vocab_eos(a) != llama_vocab_eos(b)) {
+        return false;
+    }
+
+    const int32_t n_samples = std::min<int32_t>(n_tokens, 256);
+    char piece_a[256];
+    char piece_b[256];
+    for (int32_t i = 0; i < n_samples; i++) {
+        llama_token token = (llama_token) ((int64_t) i * n_tokens / n_samples);
+        int n_a = llama_token_to_piece(a, token, piece_a, sizeof(piece_a), 0, true);
+        int n_b = llama_token_to_piece(b, token, piece_b, sizeof(piece_b), 0, true);
+        if (n_a != n_b || (n_a > 0 && std::memcmp(piece_a, piece_b, n_a) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LLMSession::set_draft_model(const std::string & model_path, int n_draft) {
+    pImpl->wait_async();
+    ModelHandle draft_model;
+    try {
+        draft_model = ModelHandle::load(model_path, pImpl->config);
+    } catch (const std::runtime_error &) {
+        throw std::runtime_error("Failed to load draft model from: " + model_path);
+    }
+
+    if (!same_vocab(llama_model_get_vocab(draft_model.get()), pImpl->vocab)) {
+        throw std::runtime_error("Draft model vocabulary does not match: " + model_path);
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = llama_n_ctx(pImpl->ctx);
+    ctx_params.n_batch = llama_n_batch(pImpl->ctx);
+    ctx_params.n_threads = pImpl->config.n_threads;
+    ctx_params.n_threads_batch = pImpl->config.n_threads_batch;
+
+    llama_context * draft_ctx = llama_init_from_model(draft_model.get(), ctx_params);
+    if (!draft_ctx) {
+        throw std::runtime_error("Failed to create draft context");
+    }
+
+    shared_context & shared = *pImpl->shared;
+    if (shared.draft_ctx) llama_free(shared.draft_ctx);
+    shared.draft_model = draft_model;
+    shared.draft_ctx = draft_ctx;
+    shared.draft_tokens.clear();
+    shared.n_draft = n_draft;
+}
+
+CompiledOptions LLMSession::compile_options(const std::vector<std::string> & options) const {
+    return CompiledOptions(pImpl->vocab, options);
+}
+
+CompiledStops LLMSession::compile_stops(const std::vector<std::string> & stop_sequences) const {
+    return CompiledStops(pImpl->vocab, stop_sequences);
+}
+
+CompiledPattern LLMSession::compile_pattern(
+    PatternType pattern,
+    const std::string & regex_pattern,
+    const std::vector<std::string> & stop_sequences
+) const {
+    return CompiledPattern(pImpl->vocab, pattern, regex_pattern, stop_sequences);
+}
 
 std::string LLMSession::select(const std::vector<std::string> & options, const std::string & var_name) {
-    // Tokenize all options
-    std::vector<std::vector<llama_token>> option_tokens;
-    int max_length = 0;
+    pImpl->wait_async();
+    return select(pImpl->get_options(options), var_name);
+}
 
-    for (const auto & opt : options) {
-        std::vector<llama_token> tokens(opt.size() + 8);
-        int n = llama_tokenize(pImpl->vocab, opt.c_str(), opt.size(), tokens.data(), tokens.size(), false, false);
-        tokens.resize(n);
-        option_tokens.push_back(tokens);
-        max_length = std::max(max_length, n);
+std::string LLMSession::select(const CompiledOptions & options, const std::string & var_name) {
+    pImpl->wait_async();
+    if (options.empty()) {
+        throw std::runtime_error("select() called with an empty CompiledOptions handle");
     }
+    pImpl->check_vocab(options.get().vocab, "CompiledOptions");
+
+    const auto & option_tokens = options.get().option_tokens;
+    size_t max_length = options.get().max_length;
+
+    pImpl->last_stats = GenerationStats();
+    pImpl->last_stats.reason = pImpl->flush(true);
+    if (pImpl->last_stats.reason != STOP_NONE) {
+        return "";
+    }
+    pImpl->ensure_logits();
+    pImpl->ensure_room(max_length);
 
     // Generate with prefix_select sampler, checking after each token if we've matched an option
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_prefix_select(pImpl->vocab, options));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.0f));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+    llama_sampler * smpl = pImpl->select_chain(options);
 
     std::vector<llama_token> generated_tokens;
+    std::vector<llama_token> pending;
     std::string selected;
-
-    for (int i = 0; i < max_length; i++) {
-        llama_token new_token = llama_sampler_sample(smpl, pImpl->ctx, -1);
+    const llama_pos n_past = llama_memory_seq_pos_max(llama_get_memory(pImpl->ctx), pImpl->seq_id) + 1;
+
+    for (size_t i = 0; i < max_length; i++) {
+        // Once the options diverge, the rest of the chosen option is forced and
+        // decoded in one batch together with the token that picked it
+        llama_token new_token;
+        token_logprob lp = {};
+        if (sample_forced_token(smpl, &new_token)) {
+            lp.token = new_token;
+            lp.logprob = NAN;
+            lp.rank = -1;
+            lp.removed_logmass = NAN;
+        } else {
+            stop_reason reason = pImpl->interrupted();
+            if (reason != STOP_NONE) {
+                // A partial option is not kept; undo the tokens decoded so far
+                if ((int) generated_tokens.size() > (int) pending.size()) {
+                    llama_memory_seq_rm(llama_get_memory(pImpl->ctx), pImpl->seq_id, n_past, -1);
+                    pImpl->logits_stale = true;
+                }
+                pImpl->last_stats.reason = reason;
+                return "";
+            }
+            if (!decode_tokens(pImpl->ctx, pending, pImpl->seq_id)) {
+                throw std::runtime_error("Failed to decode token");
+            }
+            new_token = sample_token(smpl, pImpl->ctx, -1, pImpl->logprobs_enabled ? &lp : nullptr);
+        }
 
         if (llama_vocab_is_eog(pImpl->vocab, new_token)) {
+            pImpl->last_stats.reason = STOP_EOG;
             break;
         }
+        pImpl->last_stats.tokens_generated++;
+        if (pImpl->logprobs_enabled) {
+            pImpl->last_stats.logprobs.push_back(lp);
+        }
 
         generated_tokens.push_back(new_token);
-
-        // Decode token into context BEFORE checking for match
-        if (llama_decode(pImpl->ctx, llama_batch_get_one(&new_token, 1)) != 0) {
-            throw std::runtime_error("Failed to decode token");
-        }
+        pending.push_back(new_token);
 
         // Check if we've fully matched any option
         for (size_t opt_idx = 0; opt_idx < option_tokens.size(); opt_idx++) {
-            if (generated_tokens.size() == option_tokens[opt_idx].size()) {
-                bool match = true;
-                for (size_t j = 0; j < generated_tokens.size(); j++) {
-                    if (generated_tokens[j] != option_tokens[opt_idx][j]) {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match) {
-                    selected = options[opt_idx];
-                    break;
-                }
+            if (generated_tokens == option_tokens[opt_idx]) {
+                selected = options.get().options[opt_idx];
+                break;
             }
         }
 
@@ -127,52 +1508,224 @@ std::string LLMSession::select(const std::vector<std::string> & options, const s
         }
     }
 
-    llama_sampler_free(smpl);
+    // Decode the remaining tokens into context, unless a program run decodes them with its
+    // next text
+    if (pImpl->defer_decode) {
+        pImpl->n_undecoded += pending.size();
+    } else if (!decode_tokens(pImpl->ctx, pending, pImpl->seq_id)) {
+        throw std::runtime_error("Failed to decode token");
+    }
 
     // Add tokens to context
     for (llama_token token : generated_tokens) {
         pImpl->context_tokens.push_back(token);
     }
 
-    pImpl->accumulated_text += selected;
-
-    if (!var_name.empty()) {
-        pImpl->variables[var_name] = selected;
-    }
+    pImpl->accumulated_text.append(selected);
+
+    if (!var_name.empty()) {
+        pImpl->variables[var_name] = selected;
+    }
+
+    return selected;
+}
+
+std::string LLMSession::generate(int max_tokens, float temperature, const std::string & var_name) {
+    return generate(max_tokens, std::vector<std::string>(), temperature, var_name);
+}
+
+std::string LLMSession::generate(
+    int max_tokens,
+    const std::vector<std::string> & stop_sequences,
+    float temperature,
+    const std::string & var_name
+) {
+    GenerateOptions options;
+    options.max_tokens = max_tokens;
+    options.temperature = temperature;
+    options.stop_sequences = stop_sequences;
+    options.var_name = var_name;
+    return generate(options);
+}
+
+std::string LLMSession::generate(const GenerateOptions & options) {
+    pImpl->wait_async();
+    pImpl->check_vocab(options);
+
+    // Buffered text is evaluated first; nothing is sampled if that is interrupted
+    pImpl->last_stats = GenerationStats();
+    pImpl->last_stats.reason = pImpl->flush(true);
+    if (pImpl->last_stats.reason != STOP_NONE) {
+        if (!options.var_name.empty()) {
+            pImpl->variables[options.var_name] = "";
+        }
+        return "";
+    }
+    pImpl->ensure_logits();
+
+    CompiledStops stops = options.compiled_stops;
+    if (stops.empty() && !options.stop_sequences.empty()) {
+        stops = pImpl->get_stops(options.stop_sequences);
+    }
+
+    CompiledPattern pattern = options.compiled_pattern;
+    if (pattern.empty() && options.pattern != PATTERN_NONE) {
+        pattern = pImpl->get_pattern(options.pattern, options.regex_pattern, options.stop_sequences);
+    }
+
+    static const std::vector<std::string> no_stop_sequences;
+    const std::vector<std::string> & stop_sequences = stops.empty() ? no_stop_sequences : stops.get().sequences;
+
+    generate_params params;
+    params.max_tokens = options.max_tokens;
+    params.temperature = options.temperature;
+    params.stop_sequences = stop_sequences;
+    params.sampler = pImpl->generate_chain(pattern, stops, options.temperature, options.seed);
+    params.on_text = options.on_text;
+    params.cancel = pImpl->cancel_token.get();
+    params.deadline = pImpl->deadline;
+    params.logprobs = pImpl->logprobs_enabled;
+    params.seq_id = pImpl->seq_id;
+    if (pImpl->shared->draft_ctx) {
+        Impl * impl = pImpl.get();
+        params.n_draft = pImpl->shared->n_draft;
+        params.drafter = [impl](const std::vector<llama_token> & tokens, const llama_sampler * smpl,
+                                int n_max, std::vector<llama_token> & draft) {
+            impl->propose_draft(tokens, smpl, n_max, draft);
+        };
+    } else if (options.prompt_lookup) {
+        params.lookup_tokens = &pImpl->context_tokens;
+    }
+    // Tokens of the first part that the min_tokens continuation tracks in context_tokens
+    size_t n_protected = 0;
+    if (pImpl->shift_sink >= 0) {
+        Impl * impl = pImpl.get();
+        params.make_room = [impl, &n_protected](int n_tokens) {
+            impl->make_room(n_tokens, n_protected);
+        };
+    }
+
+    generate_result result;
+    if (options.n_beams > 1) {
+        // Beams copy the context's cells, so room for all of them is made up front
+        pImpl->ensure_room((size_t) options.n_beams * std::max(options.max_tokens, 0));
+        std::vector<llama_seq_id> seq_ids = pImpl->acquire_sequences(options.n_beams);
+        try {
+            result = ::generate_beam(pImpl->ctx, pImpl->vocab, params, pImpl->seq_id, seq_ids);
+        } catch (...) {
+            pImpl->release_sequences(seq_ids);
+            throw;
+        }
+        pImpl->release_sequences(seq_ids);
+
+        // Nothing was decoded into the session if the winner has no tokens to keep
+        if (result.tokens.size() <= (result.stopped_by_sequence ? 1u : 0u)) {
+            pImpl->logits_stale = true;
+        }
+        if (options.on_text && !result.text.empty()) {
+            options.on_text(result.text.data(), result.text.size());
+        }
+    } else {
+        // A program run decodes the last tokens together with its next text
+        params.leave_pending = pImpl->defer_decode && options.min_tokens <= 0;
+        result = ::generate(pImpl->ctx, pImpl->vocab, params);
+    }
+
+    bool can_continue = result.reason == STOP_EOG || result.reason == STOP_MAX_TOKENS;
+    if (options.n_beams <= 1 && result.tokens_generated < options.min_tokens && can_continue) {
+        int additional_tokens = options.min_tokens - result.tokens_generated;
+        params.max_tokens = additional_tokens;
+        params.stop_sequences.clear();
+        params.sampler = pImpl->generate_chain(pattern, CompiledStops(), options.temperature, options.seed);
 
-    return selected;
-}
+        // Carry the pattern state over into the continuation chain
+        for (llama_token token : result.tokens) {
+            llama_sampler_accept(params.sampler, token);
+        }
 
-std::string LLMSession::generate(int max_tokens, float temperature, const std::string & var_name) {
-    return generate(max_tokens, {}, temperature, var_name);
-}
+        // Speculation continues from context_tokens, which does not include the first part yet
+        pImpl->context_tokens.insert(pImpl->context_tokens.end(), result.tokens.begin(), result.tokens.end());
+        n_protected = result.tokens.size();
+        params.leave_pending = pImpl->defer_decode;
 
-std::string LLMSession::generate(
-    int max_tokens,
-    const std::vector<std::string> & stop_sequences,
-    float temperature,
-    const std::string & var_name
-) {
-    generate_params params;
-    params.max_tokens = max_tokens;
-    params.temperature = temperature;
-    params.stop_sequences = stop_sequences;
+        generate_result additional = ::generate(pImpl->ctx, pImpl->vocab, params);
 
-    generate_result result = ::generate(pImpl->ctx, pImpl->vocab, params);
+        pImpl->context_tokens.resize(pImpl->context_tokens.size() - result.tokens.size());
+        result.tokens.insert(result.tokens.end(), additional.tokens.begin(), additional.tokens.end());
+        result.text += additional.text;
+        result.tokens_generated += additional.tokens_generated;
+        result.tokens_forced += additional.tokens_forced;
+        result.draft_proposed += additional.draft_proposed;
+        result.draft_accepted += additional.draft_accepted;
+        result.reason = additional.reason;
+        result.n_pending = additional.n_pending;
+        result.logprobs.insert(result.logprobs.end(), additional.logprobs.begin(), additional.logprobs.end());
+    }
 
-    // Tokens in result.tokens were already decoded to llama context during generation
-    // (except possibly the last token if stopped by sequence)
-    // We just need to track them
-    for (llama_token token : result.tokens) {
-        pImpl->context_tokens.push_back(token);
+    pImpl->last_stats.tokens_generated = result.tokens_generated;
+    pImpl->last_stats.tokens_forced = result.tokens_forced;
+    pImpl->last_stats.draft_proposed = result.draft_proposed;
+    pImpl->last_stats.draft_accepted = result.draft_accepted;
+    pImpl->last_stats.reason = result.reason;
+    pImpl->last_stats.logprobs.swap(result.logprobs);
+
+    if (pImpl->shift_blocked) {
+        // The tokens of the decode that failed are dropped together with their text
+        llama_pos n_past = llama_memory_seq_pos_max(llama_get_memory(pImpl->ctx), pImpl->seq_id) + 1;
+        size_t n_kept = (size_t) std::max<llama_pos>(n_past - (llama_pos) pImpl->context_tokens.size(), 0);
+        while (result.tokens.size() > n_kept) {
+            char buf[256];
+            int n = llama_token_to_piece(pImpl->vocab, result.tokens.back(), buf, sizeof(buf), 0, false);
+            if (n > 0 && result.text.size() >= (size_t) n && result.text.compare(result.text.size() - n, n, buf, n) == 0) {
+                result.text.resize(result.text.size() - n);
+            }
+            result.tokens.pop_back();
+        }
+        result.stopped_by_sequence = false;
+        result.n_pending = 0;
     }
 
-    pImpl->accumulated_text += result.text;
+    // Tokens in result.tokens were already decoded to llama context during generation,
+    // except the last one if it completed a stop sequence; that one is not tracked
+    size_t n_decoded = result.tokens.size() - (result.stopped_by_sequence ? 1 : 0);
+    pImpl->context_tokens.insert(pImpl->context_tokens.end(), result.tokens.begin(), result.tokens.begin() + n_decoded);
+    pImpl->n_undecoded += result.n_pending;
+
+    pImpl->accumulated_text.append(result.text);
 
-    // If generation stopped due to a stop sequence, encode and add it to context
+    // The decode that needed the blocked shift failed; what was decoded before it is kept
+    pImpl->throw_if_shift_blocked();
+
+    // If generation stopped due to a stop sequence, add it to the context. Decoded tokens may
+    // already hold its beginning and the token completing it may carry text before it, so the
+    // KV cache keeps the tokens ending within result.text and the rest is encoded again.
     if (result.stopped_by_sequence && !result.stop_sequence.empty()) {
-        pImpl->encode_and_eval(result.stop_sequence);
-        pImpl->accumulated_text += result.stop_sequence;
+        size_t n_keep = 0;
+        size_t kept_length = 0;
+        for (; n_keep < n_decoded; n_keep++) {
+            char buf[256];
+            int n = llama_token_to_piece(pImpl->vocab, result.tokens[n_keep], buf, sizeof(buf), 0, false);
+            if (kept_length + std::max(n, 0) > result.text.size()) {
+                break;
+            }
+            kept_length += std::max(n, 0);
+        }
+        pImpl->truncate(pImpl->context_tokens.size() - (n_decoded - n_keep));
+
+        std::string tail = result.text.substr(kept_length);
+        stop_reason reason;
+        try {
+            reason = pImpl->encode_and_eval(tail + result.stop_sequence);
+        } catch (const std::runtime_error &) {
+            pImpl->accumulated_text.truncate(pImpl->accumulated_text.end() - tail.size());
+            throw;
+        }
+        if (reason == STOP_NONE) {
+            pImpl->accumulated_text.append(result.stop_sequence);
+        } else {
+            pImpl->accumulated_text.truncate(pImpl->accumulated_text.end() - tail.size());
+            pImpl->last_stats.reason = reason;
+        }
     }
     // If we didn't stop by sequence but have stop sequences defined,
     // check if we should auto-complete a stop sequence
@@ -194,8 +1747,12 @@ std::string LLMSession::generate(
                         std::string remainder = seq.substr(i);
                         std::cerr << "[AUTO-COMPLETE] Text ends with: '" << end_part << "'" << std::endl;
                         std::cerr << "[AUTO-COMPLETE] Completing with: '" << remainder << "'" << std::endl;
-                        pImpl->encode_and_eval(remainder);
-                        pImpl->accumulated_text += remainder;
+                        stop_reason reason = pImpl->encode_and_eval(remainder);
+                        if (reason == STOP_NONE) {
+                            pImpl->accumulated_text.append(remainder);
+                        } else {
+                            pImpl->last_stats.reason = reason;
+                        }
                         completed = true;
                         break;
                     }
@@ -204,109 +1761,563 @@ std::string LLMSession::generate(
         }
     }
 
-    if (!var_name.empty()) {
-        pImpl->variables[var_name] = result.text;
+    if (!options.var_name.empty()) {
+        pImpl->variables[options.var_name] = result.text;
     }
 
     return result.text;
 }
 
-std::string LLMSession::generate(const GenerateOptions & options) {
-    generate_params params;
-    params.max_tokens = options.max_tokens;
-    params.temperature = options.temperature;
-    params.stop_sequences = options.stop_sequences;
+std::vector<std::string> LLMSession::generate_n(int n, const GenerateOptions & options) {
+    pImpl->wait_async();
+    std::vector<std::string> texts;
+    pImpl->last_stats = GenerationStats();
+    if (n <= 0) {
+        return texts;
+    }
+    pImpl->check_vocab(options);
+    pImpl->ensure_logits();
 
-    if (options.pattern != PATTERN_NONE) {
-        params.custom_sampler = llama_sampler_init_pattern(
-            pImpl->vocab,
-            options.pattern,
-            options.regex_pattern,
-            options.stop_sequences
-        );
+    CompiledStops stops = options.compiled_stops;
+    if (stops.empty() && !options.stop_sequences.empty()) {
+        stops = pImpl->get_stops(options.stop_sequences);
     }
 
-    generate_result result = ::generate(pImpl->ctx, pImpl->vocab, params);
+    CompiledPattern pattern = options.compiled_pattern;
+    if (pattern.empty() && options.pattern != PATTERN_NONE) {
+        pattern = pImpl->get_pattern(options.pattern, options.regex_pattern, options.stop_sequences);
+    }
 
-    if (result.tokens_generated < options.min_tokens && !result.stopped_by_sequence) {
-        int additional_tokens = options.min_tokens - result.tokens_generated;
-        params.max_tokens = additional_tokens;
-        params.stop_sequences.clear();
+    generate_params params;
+    params.max_tokens = options.max_tokens;
+    params.temperature = options.temperature;
+    params.seed = options.seed;
+    if (!stops.empty()) {
+        params.stop_sequences = stops.get().sequences;
+    }
+    // Used as a template: every stream clones it with its own dist seed
+    params.sampler = pImpl->generate_chain(pattern, stops, options.temperature, options.seed);
+    params.cancel = pImpl->cancel_token.get();
+    params.deadline = pImpl->deadline;
+
+    pImpl->ensure_room((size_t) n * std::max(options.max_tokens, 0));
+    std::vector<llama_seq_id> seq_ids = pImpl->acquire_sequences(n);
+    std::vector<generate_result> results;
+    try {
+        results = ::generate_n(pImpl->ctx, pImpl->vocab, params, pImpl->seq_id, seq_ids);
+    } catch (...) {
+        pImpl->release_sequences(seq_ids);
+        throw;
+    }
+    pImpl->release_sequences(seq_ids);
+    pImpl->logits_stale = true;
+
+    for (const auto & result : results) {
+        texts.push_back(result.text);
+        pImpl->last_stats.tokens_generated += result.tokens_generated;
+        pImpl->last_stats.tokens_forced += result.tokens_forced;
+        if (result.reason == STOP_CANCELLED || result.reason == STOP_DEADLINE || result.reason == STOP_ERROR) {
+            pImpl->last_stats.reason = result.reason;
+        }
+    }
+    return texts;
+}
 
-        generate_result additional = ::generate(pImpl->ctx, pImpl->vocab, params);
+std::map<std::string, std::string> LLMSession::fan_out(const std::vector<FanOutField> & fields) {
+    pImpl->wait_async();
+    std::map<std::string, std::string> values;
+    pImpl->last_stats = GenerationStats();
+    if (fields.empty()) {
+        return values;
+    }
+    for (const FanOutField & field : fields) {
+        if (!field.compiled_options.empty()) {
+            pImpl->check_vocab(field.compiled_options.get().vocab, "CompiledOptions");
+        }
+        pImpl->check_vocab(field.generate);
+    }
+    pImpl->ensure_logits();
+
+    // Chains are cloned off the pool, which may free its chains while later fields add theirs
+    std::vector<fan_out_branch> branches(fields.size());
+    std::vector<CompiledOptions> options(fields.size());
+    size_t n_tokens = 0;
+    for (size_t i = 0; i < fields.size(); i++) {
+        const FanOutField & field = fields[i];
+        fan_out_branch & branch = branches[i];
+        generate_params & params = branch.params;
+        branch.prompt = pImpl->tokenize(field.prompt, pImpl->context_tokens.empty());
+
+        if (!field.compiled_options.empty() || !field.options.empty()) {
+            options[i] = field.compiled_options.empty() ? pImpl->get_options(field.options) : field.compiled_options;
+            params.max_tokens = options[i].get().max_length;
+            params.temperature = 0.0f;
+            params.sampler = llama_sampler_clone(pImpl->select_chain(options[i]));
+            branch.option_tokens = &options[i].get().option_tokens;
+        } else {
+            const GenerateOptions & generate = field.generate;
+            CompiledStops stops = generate.compiled_stops;
+            if (stops.empty() && !generate.stop_sequences.empty()) {
+                stops = pImpl->get_stops(generate.stop_sequences);
+            }
+            CompiledPattern pattern = generate.compiled_pattern;
+            if (pattern.empty() && generate.pattern != PATTERN_NONE) {
+                pattern = pImpl->get_pattern(generate.pattern, generate.regex_pattern, generate.stop_sequences);
+            }
+            params.max_tokens = generate.max_tokens;
+            params.temperature = generate.temperature;
+            params.seed = generate.seed;
+            if (!stops.empty()) {
+                params.stop_sequences = stops.get().sequences;
+            }
+            params.sampler = llama_sampler_clone(pImpl->generate_chain(pattern, stops, generate.temperature, generate.seed));
+        }
+        n_tokens += branch.prompt.size() + std::max(params.max_tokens, 0);
+    }
 
-        for (llama_token token : additional.tokens) {
-            pImpl->context_tokens.push_back(token);
+    std::vector<generate_result> results;
+    try {
+        pImpl->ensure_room(n_tokens);
+        // As many fields per round as there are free sequences
+        const std::vector<bool> & seq_in_use = pImpl->shared->seq_in_use;
+        while (results.size() < branches.size()) {
+            int n_free = std::count(seq_in_use.begin() + 1, seq_in_use.end(), false);
+            int n = std::min<int>(std::max(n_free, 1), branches.size() - results.size());
+            std::vector<fan_out_branch> round(branches.begin() + results.size(), branches.begin() + results.size() + n);
+            std::vector<llama_seq_id> seq_ids = pImpl->acquire_sequences(n);
+            std::vector<generate_result> done;
+            try {
+                done = ::generate_fan_out(pImpl->ctx, pImpl->vocab, round, pImpl->seq_id, seq_ids,
+                                          pImpl->cancel_token.get(), pImpl->deadline);
+            } catch (...) {
+                pImpl->release_sequences(seq_ids);
+                throw;
+            }
+            pImpl->release_sequences(seq_ids);
+            pImpl->logits_stale = true;
+            results.insert(results.end(), done.begin(), done.end());
         }
-        result.text += additional.text;
-        result.tokens_generated += additional.tokens_generated;
+    } catch (...) {
+        for (auto & branch : branches) {
+            llama_sampler_free(branch.params.sampler);
+        }
+        throw;
+    }
+    for (auto & branch : branches) {
+        llama_sampler_free(branch.params.sampler);
     }
 
-    for (llama_token token : result.tokens) {
-        pImpl->context_tokens.push_back(token);
+    for (size_t i = 0; i < fields.size(); i++) {
+        const generate_result & result = results[i];
+        std::string value = result.text;
+        if (branches[i].option_tokens) {
+            // A select that ended without completing an option has no value
+            value.clear();
+            const std::vector<std::vector<llama_token>> & option_tokens = *branches[i].option_tokens;
+            for (size_t k = 0; k < option_tokens.size(); k++) {
+                if (result.tokens == option_tokens[k]) {
+                    value = options[i].get().options[k];
+                    break;
+                }
+            }
+        }
+        values[fields[i].name] = value;
+        pImpl->variables[fields[i].name] = value;
+        pImpl->last_stats.tokens_generated += result.tokens_generated;
+        pImpl->last_stats.tokens_forced += result.tokens_forced;
+        if (result.reason == STOP_CANCELLED || result.reason == STOP_DEADLINE || result.reason == STOP_ERROR) {
+            pImpl->last_stats.reason = result.reason;
+        }
     }
+    return values;
+}
 
-    pImpl->accumulated_text += result.text;
+CompiledProgram LLMSession::compile_program(const std::string & source) const {
+    return CompiledProgram(pImpl->vocab, source);
+}
 
-    // If generation stopped due to a stop sequence, add it to the context
-    if (result.stopped_by_sequence && !result.stop_sequence.empty()) {
-        pImpl->encode_and_eval(result.stop_sequence);
-        pImpl->accumulated_text += result.stop_sequence;
-    }
-    // If we didn't stop by sequence but have stop sequences defined,
-    // check if we should auto-complete a stop sequence
-    else if (!options.stop_sequences.empty() && result.tokens_generated >= params.max_tokens) {
-        // Check if the generated text ends with a partial stop sequence
-        bool completed = false;
-        for (const auto & seq : options.stop_sequences) {
-            if (completed) break;
+std::map<std::string, std::string> LLMSession::run(
+    const std::string & source,
+    const std::map<std::string, std::string> & inputs
+) {
+    pImpl->wait_async();
+    return run(pImpl->get_program(source), inputs);
+}
 
-            // Check if the end of generated text starts any of the stop sequences
-            // Start from longest match to shortest
-            for (int i = seq.length() - 1; i >= 1; i--) {
-                if (result.text.length() >= (size_t)i) {
-                    std::string end_part = result.text.substr(result.text.length() - i);
-                    std::string seq_start = seq.substr(0, i);
+std::map<std::string, std::string> LLMSession::run(
+    const CompiledProgram & program,
+    const std::map<std::string, std::string> & inputs
+) {
+    pImpl->wait_async();
+    if (program.empty()) {
+        throw std::runtime_error("run() called with an empty CompiledProgram handle");
+    }
+    if (program.get().vocab != pImpl->vocab) {
+        throw std::runtime_error("The program was compiled for another model");
+    }
 
-                    if (end_part == seq_start) {
-                        // Found partial match, complete the stop sequence
-                        std::string remainder = seq.substr(i);
-                        std::cerr << "[AUTO-COMPLETE] Text ends with: '" << end_part << "'" << std::endl;
-                        std::cerr << "[AUTO-COMPLETE] Completing with: '" << remainder << "'" << std::endl;
-                        pImpl->encode_and_eval(remainder);
-                        pImpl->accumulated_text += remainder;
-                        completed = true;
-                        break;
-                    }
+    std::map<std::string, std::string> values;
+    GenerationStats stats;
+    auto absorb = [&]() {
+        GenerationStats & last = pImpl->last_stats;
+        stats.tokens_generated += last.tokens_generated;
+        stats.tokens_forced += last.tokens_forced;
+        stats.draft_proposed += last.draft_proposed;
+        stats.draft_accepted += last.draft_accepted;
+        stats.tokens_discarded += last.tokens_discarded;
+        stats.logprobs.insert(stats.logprobs.end(), last.logprobs.begin(), last.logprobs.end());
+        last = GenerationStats();
+    };
+    pImpl->last_stats = GenerationStats();
+
+    // Text is only tokenized and queued; it is decoded by the flush before the next hole,
+    // together with the tokens the previous hole left undecoded
+    const std::vector<CompiledProgram::Step> & steps = program.get().steps;
+    for (size_t i = 0; i < steps.size(); i++) {
+        const CompiledProgram::Step & step = steps[i];
+        if (step.kind == CompiledProgram::Step::TEXT || step.kind == CompiledProgram::Step::INPUT) {
+            std::string text = step.text;
+            if (step.kind == CompiledProgram::Step::INPUT) {
+                auto input = inputs.find(step.text);
+                auto variable = pImpl->variables.find(step.text);
+                if (input != inputs.end()) {
+                    text = input->second;
+                } else if (variable != pImpl->variables.end()) {
+                    text = variable->second;
+                } else {
+                    throw std::runtime_error("Program input not provided: " + step.text);
                 }
             }
+            if (step.kind == CompiledProgram::Step::TEXT && !pImpl->context_tokens.empty()) {
+                pImpl->append_undecoded(step.tokens);
+            } else {
+                pImpl->append_undecoded(pImpl->tokenize(text, pImpl->context_tokens.empty()));
+            }
+            pImpl->accumulated_text.append(text);
+            continue;
         }
-    }
 
-    if (!options.var_name.empty()) {
-        pImpl->variables[options.var_name] = result.text;
+        stats.reason = pImpl->flush(true);
+        absorb();
+        if (stats.reason != STOP_NONE) {
+            break;
+        }
+
+        // The hole's last tokens wait for the text that follows it
+        const bool text_next = i + 1 < steps.size() &&
+            (steps[i + 1].kind == CompiledProgram::Step::TEXT || steps[i + 1].kind == CompiledProgram::Step::INPUT);
+        pImpl->defer_decode = text_next;
+        std::string value;
+        try {
+            if (step.kind == CompiledProgram::Step::SELECT) {
+                value = select(step.options, step.var_name);
+            } else {
+                GenerateOptions options = step.generate;
+                options.var_name = step.var_name;
+                value = generate(options);
+            }
+        } catch (...) {
+            pImpl->defer_decode = false;
+            throw;
+        }
+        pImpl->defer_decode = false;
+
+        stop_reason reason = pImpl->last_stats.reason;
+        absorb();
+        if (!step.var_name.empty()) {
+            values[step.var_name] = value;
+        }
+        if (reason == STOP_CANCELLED || reason == STOP_DEADLINE || reason == STOP_CALLBACK || reason == STOP_ERROR) {
+            stats.reason = reason;
+            break;
+        }
     }
 
-    return result.text;
+    if (stats.reason == STOP_NONE) {
+        stats.reason = pImpl->flush(true);
+        absorb();
+    }
+    pImpl->last_stats = stats;
+    return values;
 }
 
 LLMSession& LLMSession::operator+=(const std::string & text) {
-    pImpl->encode_and_eval(text);
-    pImpl->accumulated_text += text;
+    pImpl->wait_async();
+    pImpl->last_stats = GenerationStats();
+    pImpl->last_stats.reason = pImpl->encode_and_eval(text);
+    if (pImpl->last_stats.reason != STOP_NONE) {
+        return *this;
+    }
+    pImpl->accumulated_text.append(text);
 
     if (pImpl->auto_cache_enabled && !pImpl->has_cached && !pImpl->context_tokens.empty()) {
-        pImpl->cached_prompt_data = save_context_to_memory();
+        pImpl->cached_prompt_data = std::make_shared<const std::vector<uint8_t>>(save_context_to_memory());
         pImpl->has_cached = true;
     }
 
     return *this;
 }
 
+std::future<void> LLMSession::append_async(const std::string & text, AsyncCallback done) {
+    return pImpl->run_async<void>([text](LLMSession & session) {
+        session += text;
+        return std::string();
+    }, done);
+}
+
+std::future<std::string> LLMSession::select_async(
+    const std::vector<std::string> & options,
+    const std::string & var_name,
+    AsyncCallback done
+) {
+    return pImpl->run_async<std::string>([options, var_name](LLMSession & session) {
+        return session.select(options, var_name);
+    }, done);
+}
+
+std::future<std::string> LLMSession::generate_async(const GenerateOptions & options, AsyncCallback done) {
+    return pImpl->run_async<std::string>([options](LLMSession & session) {
+        return session.generate(options);
+    }, done);
+}
+
+void LLMSession::set_prompt(const std::string & text) {
+    pImpl->wait_async();
+    pImpl->last_stats = GenerationStats();
+    std::vector<llama_token> tokens = pImpl->tokenize(text, true);
+    size_t n_reused = 0;
+    pImpl->last_stats.reason = pImpl->reuse_prefix(tokens, &n_reused);
+    pImpl->last_stats.tokens_reused = n_reused;
+    if (pImpl->last_stats.reason != STOP_NONE) {
+        pImpl->accumulated_text.assign(pImpl->detokenize(pImpl->context_tokens));
+        return;
+    }
+    pImpl->accumulated_text.assign(text);
+
+    if (pImpl->auto_cache_enabled && !pImpl->has_cached && !pImpl->context_tokens.empty()) {
+        pImpl->cached_prompt_data = std::make_shared<const std::vector<uint8_t>>(save_context_to_memory());
+        pImpl->has_cached = true;
+    }
+}
+
+SessionConfig LLMSession::get_config() const {
+    return pImpl->config;
+}
+
+std::string LLMSession::describe() const {
+    const SessionConfig & config = pImpl->config;
+    std::ostringstream out;
+    out << "n_ctx=" << config.context_length
+        << " n_batch=" << config.n_batch
+        << " n_ubatch=" << config.n_ubatch
+        << " n_threads=" << config.n_threads
+        << " n_threads_batch=" << config.n_threads_batch
+        << " n_seq_max=" << llama_n_seq_max(pImpl->ctx)
+        << " flash_attn=" << flash_attn_name(config.flash_attn)
+        << " kv_cache=" << kv_cache_type_name(config.kv_cache_type)
+        << " mmap=" << (config.use_mmap ? "on" : "off")
+        << " mlock=" << (config.use_mlock ? "on" : "off")
+        << " numa=" << numa_name(config.numa);
+    return out.str();
+}
+
+// Hyperparameters that determine the memory of a session
+struct model_shape {
+    int n_layer;
+    int n_head;
+    int n_head_kv;
+    int n_embd;
+    int head_dim_k;
+    int head_dim_v;
+    int n_ff;
+    int n_vocab;
+    int n_ctx_train;
+    uint64_t weights_bytes;
+};
+
+static int model_meta_int(const llama_model * model, const std::string & key, int fallback) {
+    char buf[128];
+    if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) < 0) {
+        return fallback;
+    }
+    char * end = nullptr;
+    long value = std::strtol(buf, &end, 10);
+    return end != buf && *end == '\0' && value > 0 ? (int) value : fallback;
+}
+
+static model_shape read_model_shape(const llama_model * model) {
+    model_shape shape;
+    shape.n_layer = llama_model_n_layer(model);
+    shape.n_head = std::max(1, llama_model_n_head(model));
+    shape.n_head_kv = llama_model_n_head_kv(model);
+    shape.n_embd = llama_model_n_embd(model);
+    shape.n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    shape.n_ctx_train = llama_model_n_ctx_train(model);
+    shape.weights_bytes = llama_model_size(model);
+
+    // Head sizes and the feed-forward width are only available as GGUF metadata
+    char arch[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+    const std::string prefix = std::string(arch) + ".";
+    shape.head_dim_k = model_meta_int(model, prefix + "attention.key_length", shape.n_embd / shape.n_head);
+    shape.head_dim_v = model_meta_int(model, prefix + "attention.value_length", shape.n_embd / shape.n_head);
+    shape.n_ff = model_meta_int(model, prefix + "feed_forward_length", 4 * shape.n_embd);
+    return shape;
+}
+
+// Reads the shape without loading the weights
+static model_shape load_model_shape(const std::string & model_path, bool quiet) {
+    if (quiet) {
+        llama_log_set(nullptr, nullptr);
+    }
+    backend_guard backend;
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.vocab_only = true;
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (!model) {
+        throw std::runtime_error("Failed to load model from: " + model_path);
+    }
+    model_shape shape = read_model_shape(model);
+    llama_model_free(model);
+
+    std::ifstream file(model_path, std::ios::binary | std::ios::ate);
+    shape.weights_bytes = file ? (uint64_t) file.tellg() : 0;
+    return shape;
+}
+
+static size_t tensor_bytes(ggml_type type, size_t n_elements) {
+    return n_elements * ggml_type_size(type) / ggml_blck_size(type);
+}
+
+static MemoryEstimate estimate_session_memory(const model_shape & shape, const SessionConfig & config) {
+    // llama.cpp pads the KV cache to a multiple of 256 cells
+    const size_t n_ctx = (config.context_length + 255) / 256 * 256;
+    const size_t n_batch = config.n_batch > 0 ? config.n_batch : default_n_batch(config.context_length);
+    const size_t n_ubatch = config.n_ubatch > 0 ? config.n_ubatch : std::min<size_t>(512, n_batch);
+    const ggml_type type = kv_cache_ggml_type(config.kv_cache_type);
+    const size_t f32 = sizeof(float);
+
+    MemoryEstimate estimate;
+    estimate.weights_bytes = shape.weights_bytes;
+    estimate.kv_bytes_per_token = (size_t) shape.n_layer * shape.n_head_kv *
+        (tensor_bytes(type, shape.head_dim_k) + tensor_bytes(type, shape.head_dim_v));
+    estimate.kv_bytes = estimate.kv_bytes_per_token * n_ctx;
+
+    // Layer activations are reused from layer to layer. Without flash attention the KQ
+    // scores of a ubatch against the whole context dominate; auto is counted as off.
+    size_t attention = config.flash_attn == FLASH_ATTN_ENABLED
+        ? shape.n_head * n_ubatch * shape.head_dim_v * f32
+        : shape.n_head * n_ubatch * n_ctx * f32;
+    size_t activations = n_ubatch * (4 * (size_t) shape.n_embd + 3 * (size_t) shape.n_ff) * f32;
+    size_t logits = (size_t) shape.n_vocab * (n_ubatch + DEFAULT_MAX_SEQUENCES) * f32;
+    estimate.compute_bytes = attention + activations + logits;
+
+    estimate.state_bytes = estimate.kv_bytes + shape.n_vocab * f32 + n_ctx * sizeof(llama_token);
+    return estimate;
+}
+
+MemoryEstimate LLMSession::estimate_memory(const std::string & model_path, const SessionConfig & config) {
+    validate_config(config);
+    return estimate_session_memory(load_model_shape(model_path, config.quiet), config);
+}
+
+SessionConfig LLMSession::plan_config(
+    const std::string & model_path,
+    int prompt_tokens,
+    int max_new_tokens,
+    size_t budget_bytes,
+    const SessionConfig & base
+) {
+    if (prompt_tokens < 0 || max_new_tokens < 0) {
+        throw std::runtime_error("plan_config: token counts must not be negative");
+    }
+    const model_shape shape = load_model_shape(model_path, base.quiet);
+    const int n_needed = std::max(1, prompt_tokens + max_new_tokens);
+    if (shape.n_ctx_train > 0 && n_needed > shape.n_ctx_train) {
+        throw std::runtime_error("plan_config: " + std::to_string(n_needed) + " tokens exceed the model's training context of " +
+                                 std::to_string(shape.n_ctx_train));
+    }
+
+    SessionConfig config = base;
+    config.context_length = (n_needed + 255) / 256 * 256;
+    if (shape.n_ctx_train > 0) {
+        config.context_length = std::min(config.context_length, shape.n_ctx_train);
+    }
+    config.n_batch = std::min(base.n_batch > 0 ? base.n_batch : default_n_batch(config.context_length), config.context_length);
+    config.n_ubatch = std::min(base.n_ubatch > 0 ? base.n_ubatch : 512, config.n_batch);
+    validate_config(config);
+
+    // Smaller ubatches shrink the compute buffers at some cost in prefill speed
+    MemoryEstimate estimate = estimate_session_memory(shape, config);
+    while (estimate.session_bytes() > budget_bytes && config.n_ubatch > 32) {
+        config.n_ubatch /= 2;
+        estimate = estimate_session_memory(shape, config);
+    }
+    if (estimate.session_bytes() > budget_bytes) {
+        throw std::runtime_error("plan_config: a " + std::to_string(config.context_length) + " token context needs " +
+                                 std::to_string(estimate.session_bytes()) + " bytes, budget is " + std::to_string(budget_bytes));
+    }
+    return config;
+}
+
+MemoryEstimate LLMSession::memory_usage() const {
+    pImpl->wait_async();
+    MemoryEstimate estimate = estimate_session_memory(read_model_shape(pImpl->model), pImpl->config);
+    estimate.state_bytes = llama_state_seq_get_size(pImpl->ctx, pImpl->seq_id) + 2 * sizeof(uint32_t) + 3 * sizeof(size_t) +
+                           pImpl->context_tokens.size() * sizeof(llama_token) + pImpl->accumulated_text.size();
+    return estimate;
+}
+
+GenerationStats LLMSession::get_last_stats() const {
+    pImpl->wait_async();
+    return pImpl->last_stats;
+}
+
+void LLMSession::set_cancel_token(const CancelToken & token) {
+    pImpl->cancel_token = token;
+}
+
+void LLMSession::set_deadline(std::chrono::steady_clock::time_point deadline) {
+    pImpl->deadline = deadline;
+}
+
+void LLMSession::set_prefill_callback(std::function<bool(const PrefillProgress & progress)> callback) {
+    pImpl->prefill_callback = callback;
+}
+
+void LLMSession::clear_limits() {
+    pImpl->cancel_token = CancelToken();
+    pImpl->deadline = std::chrono::steady_clock::time_point::max();
+}
+
 std::string LLMSession::get_output() const {
-    return pImpl->accumulated_text;
+    pImpl->wait_async();
+    return pImpl->accumulated_text.str();
+}
+
+std::string LLMSession::get_output_since(size_t offset) const {
+    pImpl->wait_async();
+    return pImpl->accumulated_text.str(offset);
+}
+
+size_t LLMSession::get_output_end() const {
+    pImpl->wait_async();
+    return pImpl->accumulated_text.end();
+}
+
+void LLMSession::read_output(size_t offset, const std::function<void(const char * text, size_t length)> & visit) const {
+    pImpl->wait_async();
+    pImpl->accumulated_text.read(offset, visit);
+}
+
+void LLMSession::set_output_retention(size_t max_bytes) {
+    pImpl->wait_async();
+    pImpl->accumulated_text.set_retention(max_bytes);
 }
 
 std::string LLMSession::get_variable(const std::string & var_name) const {
+    pImpl->wait_async();
     auto it = pImpl->variables.find(var_name);
     if (it != pImpl->variables.end()) {
         return it->second;
@@ -315,99 +2326,105 @@ std::string LLMSession::get_variable(const std::string & var_name) const {
 }
 
 std::map<std::string, std::string> LLMSession::get_variables() const {
+    pImpl->wait_async();
     return pImpl->variables;
 }
 
 void LLMSession::clear() {
+    pImpl->wait_async();
+    pImpl->truncate(0);
     pImpl->accumulated_text.clear();
-    pImpl->context_tokens.clear();
     pImpl->variables.clear();
 }
 
-bool LLMSession::save_context(const std::string & filepath) const {
-    size_t state_size = llama_state_get_size(pImpl->ctx);
-    std::vector<uint8_t> state_data(state_size);
-
-    size_t written = llama_state_get_data(pImpl->ctx, state_data.data(), state_size);
-    if (written == 0) {
-        return false;
+// FNV-1a over the first n tokens
+static uint64_t hash_tokens(const std::vector<llama_token> & tokens, size_t n) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t token = (uint32_t) tokens[i];
+        for (int b = 0; b < 4; b++) {
+            hash ^= (token >> (8 * b)) & 0xff;
+            hash *= 1099511628211ULL;
+        }
     }
+    return hash;
+}
 
-    FILE * fp = fopen(filepath.c_str(), "wb");
-    if (!fp) {
+SessionCheckpoint LLMSession::checkpoint() const {
+    pImpl->wait_async();
+    SessionCheckpoint checkpoint;
+    checkpoint.n_tokens = pImpl->context_tokens.size();
+    checkpoint.text_length = pImpl->accumulated_text.end();
+    checkpoint.tokens_hash = hash_tokens(pImpl->context_tokens, checkpoint.n_tokens);
+    checkpoint.variables = pImpl->variables;
+    return checkpoint;
+}
+
+bool LLMSession::rollback(const SessionCheckpoint & checkpoint) {
+    pImpl->wait_async();
+    if (checkpoint.n_tokens > pImpl->context_tokens.size() ||
+        checkpoint.text_length > pImpl->accumulated_text.end() ||
+        hash_tokens(pImpl->context_tokens, checkpoint.n_tokens) != checkpoint.tokens_hash) {
         return false;
     }
+    pImpl->truncate(checkpoint.n_tokens);
+    pImpl->accumulated_text.truncate(checkpoint.text_length);
+    pImpl->variables = checkpoint.variables;
+    return true;
+}
 
-    size_t tokens_count = pImpl->context_tokens.size();
-    fwrite(&tokens_count, sizeof(size_t), 1, fp);
-    if (tokens_count > 0) {
-        fwrite(pImpl->context_tokens.data(), sizeof(llama_token), tokens_count, fp);
-    }
+// Heads a saved context. Files from before contexts were saved per sequence have no
+// header and hold the state of the whole context.
+static const uint32_t CONTEXT_MAGIC = 0x5153434c;   // "LCSQ"
+static const uint32_t CONTEXT_VERSION = 1;
 
-    size_t text_size = pImpl->accumulated_text.size();
-    fwrite(&text_size, sizeof(size_t), 1, fp);
-    if (text_size > 0) {
-        fwrite(pImpl->accumulated_text.c_str(), sizeof(char), text_size, fp);
+bool LLMSession::save_context(const std::string & filepath) const {
+    std::vector<uint8_t> data = save_context_to_memory();
+    if (data.empty()) {
+        return false;
     }
 
-    fwrite(&written, sizeof(size_t), 1, fp);
-    fwrite(state_data.data(), 1, written, fp);
-
+    FILE * fp = fopen(filepath.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    size_t written = fwrite(data.data(), 1, data.size(), fp);
     fclose(fp);
-    return true;
+    return written == data.size();
 }
 
 bool LLMSession::load_context(const std::string & filepath) {
-    FILE * fp = fopen(filepath.c_str(), "rb");
-    if (!fp) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file) {
         return false;
     }
-
-    size_t tokens_count = 0;
-    fread(&tokens_count, sizeof(size_t), 1, fp);
-    pImpl->context_tokens.resize(tokens_count);
-    if (tokens_count > 0) {
-        fread(pImpl->context_tokens.data(), sizeof(llama_token), tokens_count, fp);
-    }
-
-    size_t text_size = 0;
-    fread(&text_size, sizeof(size_t), 1, fp);
-    pImpl->accumulated_text.resize(text_size);
-    if (text_size > 0) {
-        fread(&pImpl->accumulated_text[0], sizeof(char), text_size, fp);
-    }
-
-    size_t state_size = 0;
-    fread(&state_size, sizeof(size_t), 1, fp);
-
-    std::vector<uint8_t> state_data(state_size);
-    fread(state_data.data(), 1, state_size, fp);
-
-    size_t loaded = llama_state_set_data(pImpl->ctx, state_data.data(), state_size);
-    if (loaded == 0) {
-        fclose(fp);
+    std::vector<uint8_t> data((size_t) file.tellg());
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(data.data()), data.size())) {
         return false;
     }
-
-    fclose(fp);
-    return true;
+    return load_context_from_memory(data);
 }
 
 std::vector<uint8_t> LLMSession::save_context_to_memory() const {
+    pImpl->wait_async();
+    pImpl->flush(false);
     std::vector<uint8_t> buffer;
 
-    size_t state_size = llama_state_get_size(pImpl->ctx);
+    size_t state_size = llama_state_seq_get_size(pImpl->ctx, pImpl->seq_id);
     std::vector<uint8_t> state_data(state_size);
 
-    size_t written = llama_state_get_data(pImpl->ctx, state_data.data(), state_size);
+    size_t written = llama_state_seq_get_data(pImpl->ctx, state_data.data(), state_size, pImpl->seq_id);
     if (written == 0) {
         return buffer;
     }
 
     size_t tokens_count = pImpl->context_tokens.size();
-    size_t text_size = pImpl->accumulated_text.size();
+    std::string text = pImpl->accumulated_text.str();
+    size_t text_size = text.size();
 
-    size_t total_size = sizeof(size_t) + tokens_count * sizeof(llama_token) +
+    size_t total_size = 2 * sizeof(uint32_t) +
+                        sizeof(size_t) + tokens_count * sizeof(llama_token) +
                         sizeof(size_t) + text_size +
                         sizeof(size_t) + written;
 
@@ -418,6 +2435,9 @@ std::vector<uint8_t> LLMSession::save_context_to_memory() const {
         buffer.insert(buffer.end(), bytes, bytes + size);
     };
 
+    write_data(&CONTEXT_MAGIC, sizeof(uint32_t));
+    write_data(&CONTEXT_VERSION, sizeof(uint32_t));
+
     write_data(&tokens_count, sizeof(size_t));
     if (tokens_count > 0) {
         write_data(pImpl->context_tokens.data(), tokens_count * sizeof(llama_token));
@@ -425,7 +2445,7 @@ std::vector<uint8_t> LLMSession::save_context_to_memory() const {
 
     write_data(&text_size, sizeof(size_t));
     if (text_size > 0) {
-        write_data(pImpl->accumulated_text.c_str(), text_size);
+        write_data(text.c_str(), text_size);
     }
 
     write_data(&written, sizeof(size_t));
@@ -435,6 +2455,7 @@ std::vector<uint8_t> LLMSession::save_context_to_memory() const {
 }
 
 bool LLMSession::load_context_from_memory(const std::vector<uint8_t> & data) {
+    pImpl->wait_async();
     if (data.empty()) {
         return false;
     }
@@ -450,14 +2471,34 @@ bool LLMSession::load_context_from_memory(const std::vector<uint8_t> & data) {
         return true;
     };
 
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    if (!read_data(&magic, sizeof(uint32_t)) || !read_data(&version, sizeof(uint32_t))) {
+        return false;
+    }
+    // Without a header the state covers the whole context, which only fits an unforked session
+    const bool legacy = magic != CONTEXT_MAGIC;
+    if (legacy) {
+        if (pImpl->seq_id != 0 ||
+            std::count(pImpl->shared->seq_in_use.begin(), pImpl->shared->seq_in_use.end(), true) > 1) {
+            return false;
+        }
+        offset = 0;
+    } else if (version != CONTEXT_VERSION) {
+        return false;
+    }
+
     size_t tokens_count = 0;
     if (!read_data(&tokens_count, sizeof(size_t))) {
         return false;
     }
 
-    pImpl->context_tokens.resize(tokens_count);
+    if (tokens_count > (data.size() - offset) / sizeof(llama_token)) {
+        return false;
+    }
+    std::vector<llama_token> tokens(tokens_count);
     if (tokens_count > 0) {
-        if (!read_data(pImpl->context_tokens.data(), tokens_count * sizeof(llama_token))) {
+        if (!read_data(tokens.data(), tokens_count * sizeof(llama_token))) {
             return false;
         }
     }
@@ -467,9 +2508,12 @@ bool LLMSession::load_context_from_memory(const std::vector<uint8_t> & data) {
         return false;
     }
 
-    pImpl->accumulated_text.resize(text_size);
+    if (text_size > data.size() - offset) {
+        return false;
+    }
+    std::string text(text_size, '\0');
     if (text_size > 0) {
-        if (!read_data(&pImpl->accumulated_text[0], text_size)) {
+        if (!read_data(&text[0], text_size)) {
             return false;
         }
     }
@@ -483,20 +2527,59 @@ bool LLMSession::load_context_from_memory(const std::vector<uint8_t> & data) {
         return false;
     }
 
-    size_t loaded = llama_state_set_data(pImpl->ctx, data.data() + offset, state_size);
+    if (pImpl->load_prefix(tokens)) {
+        pImpl->accumulated_text.assign(text);
+        return true;
+    }
+
+    size_t loaded = legacy
+        ? llama_state_set_data(pImpl->ctx, data.data() + offset, state_size)
+        : llama_state_seq_set_data(pImpl->ctx, data.data() + offset, state_size, pImpl->seq_id);
+    pImpl->logits_stale = true;
     if (loaded == 0) {
+        // The sequence may be partly overwritten, so nothing of the old context is kept
+        llama_memory_seq_rm(llama_get_memory(pImpl->ctx), pImpl->seq_id, -1, -1);
+        pImpl->context_tokens.clear();
+        pImpl->n_undecoded = 0;
+        pImpl->accumulated_text.clear();
         return false;
     }
+    pImpl->context_tokens.swap(tokens);
+    pImpl->n_undecoded = 0;
+    pImpl->accumulated_text.assign(text);
 
     return true;
 }
 
+void LLMSession::enable_logprobs(bool enable) {
+    pImpl->logprobs_enabled = enable;
+}
+
+void LLMSession::enable_lazy_prefill(bool enable) {
+    pImpl->lazy_prefill = enable;
+}
+
+void LLMSession::enable_context_shift(bool enable, int n_sink, int n_discard) {
+    if (!enable) {
+        pImpl->shift_sink = -1;
+        return;
+    }
+    if (n_sink < 0 || n_discard < 0) {
+        throw std::runtime_error("Context shift needs n_sink >= 0 and n_discard >= 0");
+    }
+    if (!llama_memory_can_shift(llama_get_memory(pImpl->ctx))) {
+        throw std::runtime_error("The model's context cannot be shifted");
+    }
+    pImpl->shift_sink = n_sink;
+    pImpl->shift_discard = n_discard;
+}
+
 void LLMSession::enable_auto_cache(bool enable) {
     pImpl->auto_cache_enabled = enable;
 }
 
 std::vector<uint8_t> LLMSession::get_cached_prompt() const {
-    return pImpl->cached_prompt_data;
+    return pImpl->cached_prompt_data ? *pImpl->cached_prompt_data : std::vector<uint8_t>();
 }
 
 bool LLMSession::has_cached_prompt() const {
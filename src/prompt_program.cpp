@@ -0,0 +1,308 @@
+#include "prompt_program.h"
+#include "llama.h"
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+
+static std::vector<llama_token> tokenize_literal(const llama_vocab * vocab, const std::string & text) {
+    std::vector<llama_token> tokens(text.size() + 2);
+    int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+    }
+    if (n < 0) {
+        throw std::runtime_error("Failed to tokenize program text");
+    }
+    tokens.resize(n);
+    return tokens;
+}
+
+static std::runtime_error syntax_error(const std::string & message, size_t offset) {
+    std::ostringstream msg;
+    msg << "Program syntax error at offset " << offset << ": " << message;
+    return std::runtime_error(msg.str());
+}
+
+// One word of a tag: a bare word, a quoted string, or key=value with either as the value
+struct tag_word {
+    std::string key;
+    std::string value;
+    bool quoted;
+};
+
+// Splits the inside of {{...}} into words; offset is where it starts in the source
+static std::vector<tag_word> split_tag(const std::string & tag, size_t offset) {
+    std::vector<tag_word> words;
+    size_t i = 0;
+    while (i < tag.size()) {
+        if (std::isspace((unsigned char) tag[i])) {
+            i++;
+            continue;
+        }
+
+        tag_word word;
+        word.quoted = false;
+        size_t start = i;
+        while (i < tag.size() && !std::isspace((unsigned char) tag[i]) && tag[i] != '=' &&
+               tag[i] != '\'' && tag[i] != '"') {
+            i++;
+        }
+        std::string bare = tag.substr(start, i - start);
+        if (i < tag.size() && tag[i] == '=') {
+            if (bare.empty()) {
+                throw syntax_error("'=' without a key", offset + i);
+            }
+            word.key = bare;
+            i++;
+            start = i;
+        } else if (!bare.empty()) {
+            word.value = bare;
+            words.push_back(word);
+            continue;
+        }
+
+        if (i < tag.size() && (tag[i] == '\'' || tag[i] == '"')) {
+            char quote = tag[i++];
+            word.quoted = true;
+            while (i < tag.size() && tag[i] != quote) {
+                char c = tag[i++];
+                if (c == '\\' && i < tag.size()) {
+                    c = tag[i++];
+                    if (c == 'n') c = '\n';
+                    else if (c == 't') c = '\t';
+                }
+                word.value += c;
+            }
+            if (i == tag.size()) {
+                throw syntax_error("unterminated string", offset + start);
+            }
+            i++;
+        } else {
+            while (i < tag.size() && !std::isspace((unsigned char) tag[i])) {
+                word.value += tag[i++];
+            }
+        }
+        words.push_back(word);
+    }
+    return words;
+}
+
+static bool is_name(const std::string & text) {
+    if (text.empty() || std::isdigit((unsigned char) text[0])) {
+        return false;
+    }
+    for (char c : text) {
+        if (!std::isalnum((unsigned char) c) && c != '_' && c != '.' && c != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static long long parse_integer(const tag_word & word, size_t offset, long long min, long long max) {
+    char * end = nullptr;
+    errno = 0;
+    long long value = std::strtoll(word.value.c_str(), &end, 10);
+    if (word.value.empty() || *end != '\0') {
+        throw syntax_error(word.key + " needs an integer, got '" + word.value + "'", offset);
+    }
+    if (errno == ERANGE || value < min || value > max) {
+        throw syntax_error(word.key + " is out of range: " + word.value, offset);
+    }
+    return value;
+}
+
+static int parse_int(const tag_word & word, size_t offset) {
+    return (int) parse_integer(word, offset, INT_MIN, INT_MAX);
+}
+
+static float parse_float(const tag_word & word, size_t offset) {
+    char * end = nullptr;
+    float value = std::strtof(word.value.c_str(), &end);
+    if (word.value.empty() || *end != '\0') {
+        throw syntax_error(word.key + " needs a number, got '" + word.value + "'", offset);
+    }
+    return value;
+}
+
+static PatternType parse_pattern(const tag_word & word, size_t offset) {
+    static const char * names[] = {"numeric", "alpha", "alphanumeric", "uppercase", "lowercase", "capitalized"};
+    static const PatternType patterns[] = {PATTERN_NUMERIC, PATTERN_ALPHA, PATTERN_ALPHANUMERIC,
+                                           PATTERN_UPPERCASE, PATTERN_LOWERCASE, PATTERN_CAPITALIZED};
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        if (word.value == names[i]) {
+            return patterns[i];
+        }
+    }
+    throw syntax_error("unknown pattern '" + word.value + "'", offset);
+}
+
+static CompiledProgram::Step parse_generate(const llama_vocab * vocab, const std::vector<tag_word> & words, size_t offset) {
+    CompiledProgram::Step step;
+    step.kind = CompiledProgram::Step::GENERATE;
+    GenerateOptions & options = step.generate;
+
+    for (size_t i = 1; i < words.size(); i++) {
+        const tag_word & word = words[i];
+        if (word.key.empty()) {
+            if (i != 1) {
+                throw syntax_error("gen takes its variable name first", offset);
+            }
+            if (!is_name(word.value)) {
+                throw syntax_error("invalid variable name '" + word.value + "'", offset);
+            }
+            step.var_name = word.value;
+        } else if (word.key == "max_tokens") {
+            options.max_tokens = parse_int(word, offset);
+        } else if (word.key == "min_tokens") {
+            options.min_tokens = parse_int(word, offset);
+        } else if (word.key == "temperature") {
+            options.temperature = parse_float(word, offset);
+        } else if (word.key == "seed") {
+            options.seed = (uint32_t) parse_integer(word, offset, 0, UINT32_MAX);
+        } else if (word.key == "stop") {
+            options.stop_sequences.push_back(word.value);
+        } else if (word.key == "pattern") {
+            options.pattern = parse_pattern(word, offset);
+        } else if (word.key == "regex") {
+            options.pattern = PATTERN_REGEX;
+            options.regex_pattern = word.value;
+        } else {
+            throw syntax_error("unknown gen argument '" + word.key + "'", offset);
+        }
+    }
+
+    if (!options.stop_sequences.empty()) {
+        options.compiled_stops = CompiledStops(vocab, options.stop_sequences);
+    }
+    if (options.pattern != PATTERN_NONE) {
+        options.compiled_pattern = CompiledPattern(vocab, options.pattern, options.regex_pattern, options.stop_sequences);
+    }
+    return step;
+}
+
+CompiledProgram::CompiledProgram(const struct llama_vocab * vocab, const std::string & source) {
+    std::shared_ptr<Data> compiled(new Data());
+    compiled->vocab = vocab;
+    compiled->source = source;
+    std::vector<Step> & steps = compiled->steps;
+
+    std::string literal;
+    auto flush_literal = [&]() {
+        if (literal.empty()) {
+            return;
+        }
+        Step step;
+        step.kind = Step::TEXT;
+        step.text = literal;
+        step.tokens = tokenize_literal(vocab, literal);
+        steps.push_back(step);
+        literal.clear();
+    };
+
+    // Reads the tag starting at pos ("{{"), returning its words and moving pos past "}}"
+    auto read_tag = [&](size_t & pos) {
+        size_t start = pos + 2;
+        size_t i = start;
+        char quote = 0;
+        for (; i + 1 < source.size(); i++) {
+            if (quote) {
+                if (source[i] == '\\') i++;
+                else if (source[i] == quote) quote = 0;
+            } else if (source[i] == '\'' || source[i] == '"') {
+                quote = source[i];
+            } else if (source[i] == '}' && source[i + 1] == '}') {
+                break;
+            }
+        }
+        if (i + 1 >= source.size()) {
+            throw syntax_error("unclosed {{", pos);
+        }
+        std::vector<tag_word> words = split_tag(source.substr(start, i - start), start);
+        if (words.empty()) {
+            throw syntax_error("empty tag", pos);
+        }
+        pos = i + 2;
+        return words;
+    };
+
+    size_t pos = 0;
+    while (pos < source.size()) {
+        size_t open = source.find("{{", pos);
+        if (open == std::string::npos) {
+            literal += source.substr(pos);
+            break;
+        }
+        literal += source.substr(pos, open - pos);
+
+        size_t tag_offset = open;
+        pos = open;
+        std::vector<tag_word> words = read_tag(pos);
+        const tag_word & head = words[0];
+
+        if (!head.key.empty() || head.quoted) {
+            throw syntax_error("a tag starts with gen, #select or an input name", tag_offset);
+        }
+        if (head.value == "gen") {
+            flush_literal();
+            steps.push_back(parse_generate(vocab, words, tag_offset));
+        } else if (head.value == "#select") {
+            Step step;
+            step.kind = Step::SELECT;
+            if (words.size() > 2 || (words.size() == 2 && !words[1].key.empty())) {
+                throw syntax_error("#select takes only a variable name", tag_offset);
+            }
+            if (words.size() == 2) {
+                if (!is_name(words[1].value)) {
+                    throw syntax_error("invalid variable name '" + words[1].value + "'", tag_offset);
+                }
+                step.var_name = words[1].value;
+            }
+
+            // Options are the literal text between {{or}} tags up to {{/select}}
+            std::vector<std::string> options;
+            std::string option;
+            while (true) {
+                size_t next = source.find("{{", pos);
+                if (next == std::string::npos) {
+                    throw syntax_error("#select without {{/select}}", tag_offset);
+                }
+                option += source.substr(pos, next - pos);
+                pos = next;
+                std::vector<tag_word> inner = read_tag(pos);
+                if (inner.size() != 1 || !inner[0].key.empty() || inner[0].quoted ||
+                    (inner[0].value != "or" && inner[0].value != "/select")) {
+                    throw syntax_error("only {{or}} and {{/select}} may appear inside #select", next);
+                }
+                if (option.empty()) {
+                    throw syntax_error("empty select option", next);
+                }
+                options.push_back(option);
+                option.clear();
+                if (inner[0].value == "/select") {
+                    break;
+                }
+            }
+            flush_literal();
+            step.options = CompiledOptions(vocab, options);
+            steps.push_back(step);
+        } else if (head.value == "or" || head.value == "/select") {
+            throw syntax_error("{{" + head.value + "}} outside #select", tag_offset);
+        } else if (words.size() == 1 && is_name(head.value)) {
+            flush_literal();
+            Step step;
+            step.kind = Step::INPUT;
+            step.text = head.value;
+            steps.push_back(step);
+        } else {
+            throw syntax_error("unknown tag '" + head.value + "'", tag_offset);
+        }
+    }
+    flush_literal();
+
+    data = compiled;
+}
@@ -0,0 +1,1003 @@
+#include "session_pool.h"
+#include "constrained_generation.h"
+#include "token_filter_sampler.h"
+#include "llama.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+
+// One step of a pooled session's call as run by the scheduler: positions from keep on are
+// removed from the session's sequence, prompt is evaluated, then tokens are sampled with
+// smpl (owned by the job) if set. on_done is called on the scheduler thread when it ends.
+struct pool_job {
+    llama_seq_id seq_id = 0;
+    llama_pos keep = -1;
+    std::vector<llama_token> prompt;
+    llama_sampler * smpl = nullptr;
+    generate_params params;
+    // select: sampling ends once the tokens spell one of the options
+    CompiledOptions options;
+    CancelToken cancel;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    std::function<void(pool_job & job)> on_done;
+
+    // Scheduler state
+    bool started = false;
+    bool finished = false;
+    llama_pos n_past = 0;           // next position of the sequence
+    llama_pos prompt_start = 0;
+    size_t n_prompt_done = 0;
+    std::vector<llama_token> pending;   // sampled, not decoded yet
+    int32_t logits_idx = -1;            // batch index of the logits to sample from next
+    bool finishing = false;             // decode what is pending, then finish
+    int n_sampled = 0;
+    llama_pos batch_start = -1;         // n_past before the current batch, -1 if not in it
+
+    // Results
+    generate_result result;
+    std::string selected;
+    std::string error;
+
+    pool_job() {}
+    pool_job(const pool_job &) = delete;
+    pool_job & operator=(const pool_job &) = delete;
+
+    ~pool_job() {
+        if (smpl) llama_sampler_free(smpl);
+    }
+
+    bool prefilling() const { return n_prompt_done < prompt.size(); }
+};
+
+// Context, sequences and scheduler thread shared by a SessionPool and its sessions
+struct pool_context {
+    ModelHandle model;
+    llama_context * ctx = nullptr;
+    const llama_vocab * vocab = nullptr;
+    SessionConfig config;
+    int prefill_chunk = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable work_ready;
+    std::vector<pool_job *> queue;
+    std::vector<bool> seq_in_use;
+    PoolStats stats;
+    bool stopping = false;
+    std::thread scheduler;
+    std::thread::id scheduler_id;   // kept after the scheduler is joined
+
+    ~pool_context() {
+        if (ctx) llama_free(ctx);
+    }
+
+    std::vector<llama_token> tokenize(const std::string & text, bool add_special) const {
+        return model.tokenize(text, add_special);
+    }
+
+    // Hands the job to the scheduler, which calls its on_done and deletes it
+    void submit(std::unique_ptr<pool_job> job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            throw std::runtime_error("SessionPool was destroyed");
+        }
+        queue.push_back(job.release());
+        work_ready.notify_one();
+    }
+
+    static void complete(pool_job * job) {
+        std::unique_ptr<pool_job> owned(job);
+        if (job->on_done) {
+            job->on_done(*job);
+        }
+    }
+
+    void schedule() {
+        llama_batch batch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+        std::vector<pool_job *> active;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_ready.wait(lock, [&] { return stopping || !queue.empty() || !active.empty(); });
+            if (stopping) {
+                break;
+            }
+            active.insert(active.end(), queue.begin(), queue.end());
+            queue.clear();
+            lock.unlock();
+
+            step(active, batch);
+
+            // on_done may submit the session's next job
+            for (size_t i = 0; i < active.size();) {
+                if (active[i]->finished) {
+                    pool_job * job = active[i];
+                    active.erase(active.begin() + i);
+                    complete(job);
+                } else {
+                    i++;
+                }
+            }
+            lock.lock();
+        }
+
+        active.insert(active.end(), queue.begin(), queue.end());
+        queue.clear();
+        lock.unlock();
+        for (pool_job * job : active) {
+            job->error = "SessionPool was destroyed";
+            complete(job);
+        }
+
+        llama_batch_free(batch);
+    }
+
+    // One scheduler iteration: a batch of every generating job's pending tokens followed by
+    // prompt chunks, then sampling for every job whose logits it produced
+    void step(std::vector<pool_job *> & active, llama_batch & batch) {
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        for (pool_job * job : active) {
+            if (!job->started) {
+                job->started = true;
+                if (job->keep >= 0) {
+                    llama_memory_seq_rm(mem, job->seq_id, job->keep, -1);
+                }
+                job->n_past = llama_memory_seq_pos_max(mem, job->seq_id) + 1;
+                job->prompt_start = job->n_past;
+                if (job->prompt.empty() && !job->smpl) {
+                    job->finished = true;
+                }
+            }
+            if (!job->finished) {
+                check_limits(*job);
+            }
+            job->batch_start = -1;
+        }
+
+        const int n_batch = llama_n_batch(ctx);
+        int n_sessions = 0;
+        batch.n_tokens = 0;
+
+        // Sessions share the context's cells. Tokens are admitted only while cells are free,
+        // so a job that finds none left fails on its own instead of failing the decode of
+        // the whole batch.
+        llama_pos n_free = llama_n_ctx(ctx);
+        for (size_t s = 0; s < seq_in_use.size(); s++) {
+            n_free -= llama_memory_seq_pos_max(mem, (llama_seq_id) s) + 1;
+        }
+
+        // Decode steps go first so that generating sessions advance every iteration
+        for (pool_job * job : active) {
+            if (job->finished || job->prefilling() || job->pending.empty() || batch.n_tokens >= n_batch) {
+                continue;
+            }
+            if (n_free <= 0) {
+                n_free += fail_context_full(*job);
+                continue;
+            }
+            size_t n = std::min<size_t>({job->pending.size(), (size_t) (n_batch - batch.n_tokens), (size_t) n_free});
+            n_free -= n;
+            job->batch_start = job->n_past;
+            for (size_t k = 0; k < n; k++) {
+                add_token(batch, *job, job->pending[k], k + 1 == n);
+            }
+            job->pending.erase(job->pending.begin(), job->pending.begin() + n);
+            job->logits_idx = job->pending.empty() ? batch.n_tokens - 1 : -1;
+            n_sessions++;
+        }
+        const int n_generated = batch.n_tokens;
+
+        // Prompts share what is left of the chunk budget
+        int n_prefilling = 0;
+        for (pool_job * job : active) {
+            if (!job->finished && job->prefilling()) n_prefilling++;
+        }
+        int budget = std::min(prefill_chunk, n_batch - batch.n_tokens);
+        for (pool_job * job : active) {
+            if (job->finished || !job->prefilling() || budget <= 0) {
+                continue;
+            }
+            size_t share = std::max(1, budget / n_prefilling--);
+            if (n_free <= 0) {
+                n_free += fail_context_full(*job);
+                continue;
+            }
+            size_t n = std::min({share, job->prompt.size() - job->n_prompt_done, (size_t) n_free});
+            n_free -= n;
+            job->batch_start = job->n_past;
+            for (size_t k = 0; k < n; k++) {
+                bool last = job->n_prompt_done + 1 == job->prompt.size();
+                add_token(batch, *job, job->prompt[job->n_prompt_done], last && job->smpl);
+                job->n_prompt_done++;
+            }
+            job->logits_idx = !job->prefilling() && job->smpl ? batch.n_tokens - 1 : -1;
+            budget -= n;
+            n_sessions++;
+        }
+
+        if (batch.n_tokens == 0) {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool failed = llama_decode(ctx, batch) != 0;
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.batches++;
+            stats.decode_ms += elapsed;
+            stats.max_batch_sessions = std::max(stats.max_batch_sessions, n_sessions);
+            if (!failed) {
+                stats.generated_tokens += n_generated;
+                stats.prompt_tokens += batch.n_tokens - n_generated;
+            }
+        }
+
+        for (pool_job * job : active) {
+            if (job->batch_start < 0) {
+                continue;
+            }
+            if (failed) {
+                fail(*job, "Failed to decode batch");
+                continue;
+            }
+            if (job->prefilling()) {
+                continue;
+            }
+            if (!job->smpl || (job->finishing && job->pending.empty())) {
+                job->finished = true;
+            } else if (job->logits_idx >= 0) {
+                advance(*job);
+            }
+        }
+    }
+
+    // The session keeps its context from before the call; returns the cells this frees
+    llama_pos fail(pool_job & job, const std::string & error) {
+        llama_memory_seq_rm(llama_get_memory(ctx), job.seq_id, job.prompt_start, -1);
+        llama_pos n_freed = job.n_past - job.prompt_start;
+        job.n_past = job.prompt_start;
+        job.error = error;
+        job.finished = true;
+        return n_freed;
+    }
+
+    llama_pos fail_context_full(pool_job & job) {
+        return fail(job, "SessionPool: context is full (" + std::to_string(llama_n_ctx(ctx)) +
+                         " tokens shared by all sessions)");
+    }
+
+    void add_token(llama_batch & batch, pool_job & job, llama_token token, bool logits) {
+        int i = batch.n_tokens++;
+        batch.token[i] = token;
+        batch.pos[i] = job.n_past++;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = job.seq_id;
+        batch.logits[i] = logits;
+    }
+
+    // An interrupted prompt or select is removed again; an interrupted generate keeps what
+    // it sampled, so its pending tokens are still decoded
+    void check_limits(pool_job & job) {
+        if (job.finishing) {
+            return;
+        }
+        // The single token a generate call re-evaluates is never interrupted on its own
+        if (job.prefilling() && job.smpl) {
+            return;
+        }
+        stop_reason reason = check_interrupt(job.cancel.get(), job.deadline);
+        if (reason == STOP_NONE) {
+            return;
+        }
+
+        job.result.reason = reason;
+        if (job.prefilling() || !job.options.empty()) {
+            llama_pos from = job.prefilling() ? job.prompt_start : job.prompt_start + (llama_pos) job.prompt.size();
+            llama_memory_seq_rm(llama_get_memory(ctx), job.seq_id, from, -1);
+            job.result.tokens.clear();
+            job.pending.clear();
+            job.finished = true;
+        } else {
+            job.finishing = true;
+            job.finished = job.pending.empty();
+        }
+    }
+
+    // Samples until the job needs fresh logits, as generate() does between decodes
+    void advance(pool_job & job) {
+        bool has_logits = true;
+        while (true) {
+            if (job.n_sampled >= job.params.max_tokens) {
+                job.result.reason = STOP_MAX_TOKENS;
+                job.finishing = true;
+                break;
+            }
+
+            llama_token token;
+            if (sample_forced_token(job.smpl, &token)) {
+                job.result.tokens_forced++;
+            } else if (has_logits) {
+                token = sample_token(job.smpl, ctx, job.logits_idx, nullptr);
+            } else {
+                break;
+            }
+            job.n_sampled++;
+
+            if (!job.options.empty()) {
+                if (llama_vocab_is_eog(vocab, token)) {
+                    job.result.reason = STOP_EOG;
+                    job.finishing = true;
+                    break;
+                }
+                job.result.tokens.push_back(token);
+                job.result.tokens_generated++;
+                job.pending.push_back(token);
+                has_logits = false;
+
+                const CompiledOptions::Data & options = job.options.get();
+                for (size_t i = 0; i < options.option_tokens.size(); i++) {
+                    if (job.result.tokens == options.option_tokens[i]) {
+                        job.selected = options.options[i];
+                        job.finishing = true;
+                        break;
+                    }
+                }
+                if (job.finishing) {
+                    break;
+                }
+                continue;
+            }
+
+            // Tokens without text are not decoded, so the current logits stay valid
+            token_status status = take_token(vocab, job.params, job.result, token);
+            if (status == TOKEN_END) {
+                job.finishing = true;
+                break;
+            }
+            if (status == TOKEN_KEPT) {
+                job.pending.push_back(token);
+                has_logits = false;
+            }
+        }
+
+        job.logits_idx = -1;
+        if (job.finishing && job.pending.empty()) {
+            job.finished = true;
+        }
+    }
+
+    llama_seq_id acquire_sequence() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < seq_in_use.size(); i++) {
+            if (!seq_in_use[i]) {
+                seq_in_use[i] = true;
+                return (llama_seq_id) i;
+            }
+        }
+        throw std::runtime_error("SessionPool: all " + std::to_string(seq_in_use.size()) + " sessions are open");
+    }
+
+    void release_sequence(llama_seq_id seq_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            // No scheduler left to run a job; nothing else touches the context now
+            llama_memory_seq_rm(llama_get_memory(ctx), seq_id, -1, -1);
+        }
+        seq_in_use[seq_id] = false;
+    }
+};
+
+static llama_sampler * select_chain(const CompiledOptions & options) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(smpl, llama_sampler_init_prefix_select(options));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.0f));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+    return smpl;
+}
+
+static llama_sampler * generate_chain(const CompiledPattern & pattern, const CompiledStops & stops, float temperature, uint32_t seed) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    if (!pattern.empty()) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_pattern(pattern));
+    }
+    if (!stops.empty()) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_stop_sequence(stops));
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+    return smpl;
+}
+
+struct SessionPool::Impl {
+    std::shared_ptr<pool_context> pool;
+};
+
+// Completes a session call: reports the result or the error, then starts the next call
+typedef std::function<void(const std::string & result, std::exception_ptr error)> call_done;
+
+struct PooledSession::Impl {
+    std::shared_ptr<pool_context> pool;
+    llama_seq_id seq_id = 0;
+
+    // Guards the state below, which calls update on the scheduler thread
+    mutable std::mutex mutex;
+    std::string accumulated_text;
+    std::vector<llama_token> context_tokens;
+    std::map<std::string, std::string> variables;
+    GenerationStats last_stats;
+    CancelToken cancel_token;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Calls in the order they were made; the first one is running
+    std::deque<std::function<void()>> calls;
+    std::condition_variable idle;
+
+    // Thread running a call's done callback: the scheduler, or the caller when the call
+    // failed before submitting a job
+    std::thread::id callback_thread;
+    // Set when the session was destroyed from a callback: the Impl then owns itself and is
+    // deleted once its remaining calls have finished
+    bool detached = false;
+
+    // Clears the sequence and hands it back to the pool; waits for pending calls unless
+    // called from a callback, which those calls wait for in turn
+    static void close(std::unique_ptr<Impl> impl) {
+        {
+            std::unique_lock<std::mutex> lock(impl->mutex);
+            const std::thread::id self = std::this_thread::get_id();
+            if (self == impl->pool->scheduler_id || self == impl->callback_thread) {
+                if (!impl->calls.empty()) {
+                    impl->detached = true;
+                    impl.release();
+                    return;
+                }
+                lock.unlock();
+                impl.release()->release_later();
+                return;
+            }
+            impl->idle.wait(lock, [&impl] { return impl->calls.empty(); });
+        }
+        std::promise<void> cleared;
+        std::future<void> cleared_future = cleared.get_future();
+        try {
+            std::unique_ptr<pool_job> job = impl->new_job();
+            job->keep = 0;
+            job->on_done = [&cleared](pool_job &) { cleared.set_value(); };
+            impl->pool->submit(std::move(job));
+            cleared_future.wait();
+        } catch (const std::runtime_error &) {
+        }
+        impl->pool->release_sequence(impl->seq_id);
+    }
+
+    // Deletes this once the scheduler has cleared the sequence, after the current call
+    void release_later() {
+        std::unique_ptr<pool_job> job = new_job();
+        job->keep = 0;
+        job->on_done = [this](pool_job &) {
+            pool->release_sequence(seq_id);
+            delete this;
+        };
+        try {
+            pool->submit(std::move(job));
+        } catch (const std::runtime_error &) {
+            pool->release_sequence(seq_id);
+            delete this;
+        }
+    }
+
+    std::unique_ptr<pool_job> new_job() const {
+        std::unique_ptr<pool_job> job(new pool_job());
+        job->seq_id = seq_id;
+        std::lock_guard<std::mutex> lock(mutex);
+        job->cancel = cancel_token;
+        job->deadline = deadline;
+        return job;
+    }
+
+    // Queues a call whose body submits jobs and ends by calling done; returns its future
+    template <typename T>
+    std::future<T> start(std::function<void(const call_done & done)> body, AsyncCallback callback) {
+        std::shared_ptr<std::promise<T>> promise = std::make_shared<std::promise<T>>();
+        std::future<T> future = promise->get_future();
+        enqueue([this, body, callback, promise] {
+            call_done done = [this, callback, promise](const std::string & result, std::exception_ptr error) {
+                if (callback) {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        callback_thread = std::this_thread::get_id();
+                    }
+                    try {
+                        callback(result, error);
+                    } catch (...) {
+                        if (!error) error = std::current_exception();
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    callback_thread = std::thread::id();
+                }
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    set_result(*promise, result);
+                }
+                finish();
+            };
+            try {
+                body(done);
+            } catch (...) {
+                done("", std::current_exception());
+            }
+        });
+        return future;
+    }
+
+    static void set_result(std::promise<std::string> & promise, const std::string & result) {
+        promise.set_value(result);
+    }
+
+    static void set_result(std::promise<void> & promise, const std::string &) {
+        promise.set_value();
+    }
+
+    void enqueue(std::function<void()> call) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            calls.push_back(call);
+            if (calls.size() > 1) {
+                return;
+            }
+        }
+        call();
+    }
+
+    void finish() {
+        std::function<void()> next;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            calls.pop_front();
+            if (calls.empty()) {
+                idle.notify_all();
+                if (!detached) {
+                    return;
+                }
+            } else {
+                next = calls.front();
+            }
+        }
+        if (next) {
+            next();
+        } else {
+            release_later();
+        }
+    }
+
+    void check_vocab(const llama_vocab * compiled_for, const std::string & what) const {
+        if (compiled_for != pool->vocab) {
+            throw std::runtime_error(what + " was compiled for another model");
+        }
+    }
+
+    static std::exception_ptr job_error(const pool_job & job) {
+        return std::make_exception_ptr(std::runtime_error(job.error));
+    }
+
+    // Evaluates tokens after the first keep tokens of the context (all of it if keep < 0),
+    // then calls then with STOP_NONE, or with the reason it was interrupted and nothing kept
+    void eval_tokens(const std::vector<llama_token> & tokens, llama_pos keep, const call_done & done,
+                     std::function<void(stop_reason reason)> then) {
+        std::unique_ptr<pool_job> job = new_job();
+        job->keep = keep;
+        job->prompt = tokens;
+        job->on_done = [this, keep, done, then](pool_job & job) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (keep >= 0 && (size_t) keep < context_tokens.size()) {
+                    context_tokens.resize(keep);
+                }
+                if (job.error.empty() && job.result.reason == STOP_NONE) {
+                    context_tokens.insert(context_tokens.end(), job.prompt.begin(), job.prompt.end());
+                }
+            }
+            if (!job.error.empty()) {
+                done("", job_error(job));
+                return;
+            }
+            then(job.result.reason);
+        };
+        pool->submit(std::move(job));
+    }
+
+    // Samples with the job's chain, starting by evaluating the last context token again since
+    // other sessions have decoded since; then receives the finished job
+    void sample(std::unique_ptr<pool_job> job, const call_done & done, std::function<void(pool_job & job)> then) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (context_tokens.empty()) {
+                throw std::runtime_error("PooledSession: select() and generate() need a non-empty context");
+            }
+            job->keep = context_tokens.size() - 1;
+            job->prompt.assign(1, context_tokens.back());
+        }
+        job->on_done = [this, done, then](pool_job & job) {
+            if (!job.error.empty()) {
+                // The re-evaluated token was removed with the rest of the call
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    context_tokens.pop_back();
+                }
+                done("", job_error(job));
+                return;
+            }
+            try {
+                then(job);
+            } catch (...) {
+                done("", std::current_exception());
+            }
+        };
+        pool->submit(std::move(job));
+    }
+
+    void append(const std::string & text, const call_done & done) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            first = context_tokens.empty();
+        }
+        eval_tokens(pool->tokenize(text, first), -1, done, [this, text, done](stop_reason reason) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last_stats = GenerationStats();
+                last_stats.reason = reason;
+                if (reason == STOP_NONE) {
+                    accumulated_text += text;
+                }
+            }
+            done("", nullptr);
+        });
+    }
+
+    void select(const CompiledOptions & options, const std::string & var_name, const call_done & done) {
+        if (options.empty()) {
+            throw std::runtime_error("select() called with an empty CompiledOptions handle");
+        }
+        check_vocab(options.get().vocab, "CompiledOptions");
+        std::unique_ptr<pool_job> job = new_job();
+        job->smpl = select_chain(options);
+        job->options = options;
+        job->params.max_tokens = options.get().max_length;
+
+        sample(std::move(job), done, [this, var_name, done](pool_job & job) {
+            const generate_result & result = job.result;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last_stats = GenerationStats();
+                last_stats.tokens_generated = result.tokens_generated;
+                last_stats.tokens_forced = result.tokens_forced;
+                last_stats.reason = result.reason == STOP_MAX_TOKENS ? STOP_NONE : result.reason;
+
+                // An interrupted select removed its tokens again
+                context_tokens.insert(context_tokens.end(), result.tokens.begin(), result.tokens.end());
+                accumulated_text += job.selected;
+                if (!var_name.empty() && result.reason != STOP_CANCELLED && result.reason != STOP_DEADLINE) {
+                    variables[var_name] = job.selected;
+                }
+            }
+            done(job.selected, nullptr);
+        });
+    }
+
+    void generate(const GenerateOptions & options, const call_done & done) {
+        if (options.min_tokens > 0 || options.on_text || options.prompt_lookup || options.n_beams > 1) {
+            throw std::runtime_error("PooledSession::generate: min_tokens, on_text, prompt_lookup and n_beams are not supported");
+        }
+
+        if (!options.compiled_stops.empty()) {
+            check_vocab(options.compiled_stops.get().vocab, "CompiledStops");
+        }
+        if (!options.compiled_pattern.empty()) {
+            check_vocab(options.compiled_pattern.get().vocab, "CompiledPattern");
+        }
+
+        CompiledStops stops = options.compiled_stops;
+        if (stops.empty() && !options.stop_sequences.empty()) {
+            stops = CompiledStops(pool->vocab, options.stop_sequences);
+        }
+        CompiledPattern pattern = options.compiled_pattern;
+        if (pattern.empty() && options.pattern != PATTERN_NONE) {
+            pattern = CompiledPattern(pool->vocab, options.pattern, options.regex_pattern, options.stop_sequences);
+        }
+
+        std::unique_ptr<pool_job> job = new_job();
+        job->smpl = generate_chain(pattern, stops, options.temperature, options.seed);
+        job->params.max_tokens = options.max_tokens;
+        if (!stops.empty()) {
+            job->params.stop_sequences = stops.get().sequences;
+        }
+
+        std::string var_name = options.var_name;
+        sample(std::move(job), done, [this, var_name, done](pool_job & job) {
+            const generate_result & result = job.result;
+            // The token completing a stop sequence was not decoded
+            size_t n_decoded = result.tokens.size() - (result.stopped_by_sequence ? 1 : 0);
+            llama_pos keep = -1;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last_stats = GenerationStats();
+                last_stats.tokens_generated = result.tokens_generated;
+                last_stats.tokens_forced = result.tokens_forced;
+                last_stats.reason = result.reason;
+
+                context_tokens.insert(context_tokens.end(), result.tokens.begin(), result.tokens.begin() + n_decoded);
+                accumulated_text += result.text;
+                if (!var_name.empty()) {
+                    variables[var_name] = result.text;
+                }
+                keep = context_tokens.size();
+            }
+            if (!result.stopped_by_sequence || result.stop_sequence.empty()) {
+                done(result.text, nullptr);
+                return;
+            }
+
+            // As in LLMSession::generate, the stop sequence is added to the context by keeping
+            // the tokens that end within result.text and encoding the rest again
+            size_t n_keep = 0;
+            size_t kept_length = 0;
+            for (; n_keep < n_decoded; n_keep++) {
+                char buf[256];
+                int n = llama_token_to_piece(pool->vocab, result.tokens[n_keep], buf, sizeof(buf), 0, false);
+                if (kept_length + std::max(n, 0) > result.text.size()) {
+                    break;
+                }
+                kept_length += std::max(n, 0);
+            }
+            keep -= n_decoded - n_keep;
+
+            std::string text = result.text;
+            std::string tail = text.substr(kept_length);
+            std::string stop_sequence = result.stop_sequence;
+            eval_tokens(pool->tokenize(tail + stop_sequence, false), keep, done,
+                        [this, text, tail, stop_sequence, done](stop_reason reason) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (reason == STOP_NONE) {
+                        accumulated_text += stop_sequence;
+                    } else {
+                        accumulated_text.resize(accumulated_text.size() - tail.size());
+                        last_stats.reason = reason;
+                    }
+                }
+                done(text, nullptr);
+            });
+        });
+    }
+
+    void clear(const call_done & done) {
+        std::unique_ptr<pool_job> job = new_job();
+        job->keep = 0;
+        job->on_done = [this, done](pool_job & job) {
+            if (!job.error.empty()) {
+                done("", job_error(job));
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                context_tokens.clear();
+                accumulated_text.clear();
+                variables.clear();
+            }
+            done("", nullptr);
+        };
+        pool->submit(std::move(job));
+    }
+};
+
+SessionPool::SessionPool(const ModelHandle & model, const SessionConfig & config, int max_sessions, int prefill_chunk)
+    : pImpl(new Impl()) {
+
+    llama_context_params ctx_params = config.context_params();
+    if (model.empty()) {
+        throw std::runtime_error("SessionPool created from an empty ModelHandle");
+    }
+    if (max_sessions <= 0) {
+        throw std::runtime_error("SessionPool: max_sessions must be positive");
+    }
+    // Sessions of any length share the cells of one context
+    ctx_params.n_seq_max = max_sessions;
+    ctx_params.kv_unified = true;
+
+    std::shared_ptr<pool_context> pool = std::make_shared<pool_context>();
+    pool->model = model;
+    pool->ctx = llama_init_from_model(model.get(), ctx_params);
+    if (!pool->ctx) {
+        throw std::runtime_error("Failed to create context for " + std::to_string(max_sessions) + " sessions");
+    }
+    pool->vocab = llama_model_get_vocab(model.get());
+
+    pool->config = config;
+    pool->config.context_length = llama_n_ctx(pool->ctx);
+    pool->config.n_batch = llama_n_batch(pool->ctx);
+    pool->config.n_ubatch = llama_n_ubatch(pool->ctx);
+    pool->config.n_threads = llama_n_threads(pool->ctx);
+    pool->config.n_threads_batch = llama_n_threads_batch(pool->ctx);
+    pool->prefill_chunk = prefill_chunk > 0 ? std::min(prefill_chunk, pool->config.n_batch) : pool->config.n_ubatch;
+    pool->seq_in_use.assign(max_sessions, false);
+
+    pool->scheduler = std::thread(&pool_context::schedule, pool.get());
+    pool->scheduler_id = pool->scheduler.get_id();
+    pImpl->pool = pool;
+}
+
+SessionPool::~SessionPool() {
+    pool_context & pool = *pImpl->pool;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.work_ready.notify_all();
+    pool.scheduler.join();
+}
+
+std::unique_ptr<PooledSession> SessionPool::open() {
+    llama_seq_id seq_id = pImpl->pool->acquire_sequence();
+    std::unique_ptr<PooledSession::Impl> impl(new PooledSession::Impl());
+    impl->seq_id = seq_id;
+    impl->pool = pImpl->pool;
+    return std::unique_ptr<PooledSession>(new PooledSession(std::move(impl)));
+}
+
+int SessionPool::open_sessions() const {
+    std::lock_guard<std::mutex> lock(pImpl->pool->mutex);
+    return std::count(pImpl->pool->seq_in_use.begin(), pImpl->pool->seq_in_use.end(), true);
+}
+
+int SessionPool::max_sessions() const {
+    return pImpl->pool->seq_in_use.size();
+}
+
+CompiledOptions SessionPool::compile_options(const std::vector<std::string> & options) const {
+    return CompiledOptions(pImpl->pool->vocab, options);
+}
+
+CompiledStops SessionPool::compile_stops(const std::vector<std::string> & stop_sequences) const {
+    return CompiledStops(pImpl->pool->vocab, stop_sequences);
+}
+
+CompiledPattern SessionPool::compile_pattern(
+    PatternType pattern,
+    const std::string & regex_pattern,
+    const std::vector<std::string> & stop_sequences
+) const {
+    return CompiledPattern(pImpl->pool->vocab, pattern, regex_pattern, stop_sequences);
+}
+
+PoolStats SessionPool::get_stats() const {
+    std::lock_guard<std::mutex> lock(pImpl->pool->mutex);
+    return pImpl->pool->stats;
+}
+
+const SessionConfig & SessionPool::get_config() const {
+    return pImpl->pool->config;
+}
+
+PooledSession::PooledSession(std::unique_ptr<Impl> impl)
+    : pImpl(std::move(impl)) {
+}
+
+PooledSession::~PooledSession() {
+    Impl::close(std::move(pImpl));
+}
+
+std::future<void> PooledSession::append_async(const std::string & text, AsyncCallback done) {
+    Impl * impl = pImpl.get();
+    return impl->start<void>([impl, text](const call_done & done) {
+        impl->append(text, done);
+    }, done);
+}
+
+std::future<std::string> PooledSession::select_async(
+    const std::vector<std::string> & options,
+    const std::string & var_name,
+    AsyncCallback done
+) {
+    return select_async(CompiledOptions(pImpl->pool->vocab, options), var_name, done);
+}
+
+std::future<std::string> PooledSession::select_async(
+    const CompiledOptions & options,
+    const std::string & var_name,
+    AsyncCallback done
+) {
+    Impl * impl = pImpl.get();
+    return impl->start<std::string>([impl, options, var_name](const call_done & done) {
+        impl->select(options, var_name, done);
+    }, done);
+}
+
+std::future<std::string> PooledSession::generate_async(const GenerateOptions & options, AsyncCallback done) {
+    Impl * impl = pImpl.get();
+    return impl->start<std::string>([impl, options](const call_done & done) {
+        impl->generate(options, done);
+    }, done);
+}
+
+PooledSession & PooledSession::operator+=(const std::string & text) {
+    append_async(text).get();
+    return *this;
+}
+
+std::string PooledSession::select(const std::vector<std::string> & options, const std::string & var_name) {
+    return select_async(options, var_name).get();
+}
+
+std::string PooledSession::select(const CompiledOptions & options, const std::string & var_name) {
+    return select_async(options, var_name).get();
+}
+
+std::string PooledSession::generate(
+    int max_tokens,
+    const std::vector<std::string> & stop_sequences,
+    float temperature,
+    const std::string & var_name
+) {
+    GenerateOptions options;
+    options.max_tokens = max_tokens;
+    options.temperature = temperature;
+    options.stop_sequences = stop_sequences;
+    options.var_name = var_name;
+    return generate(options);
+}
+
+std::string PooledSession::generate(const GenerateOptions & options) {
+    return generate_async(options).get();
+}
+
+std::string PooledSession::get_output() const {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    return pImpl->accumulated_text;
+}
+
+std::string PooledSession::get_variable(const std::string & var_name) const {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    auto it = pImpl->variables.find(var_name);
+    if (it != pImpl->variables.end()) {
+        return it->second;
+    }
+    return "";
+}
+
+std::map<std::string, std::string> PooledSession::get_variables() const {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    return pImpl->variables;
+}
+
+GenerationStats PooledSession::get_last_stats() const {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    return pImpl->last_stats;
+}
+
+void PooledSession::set_cancel_token(const CancelToken & token) {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    pImpl->cancel_token = token;
+}
+
+void PooledSession::set_deadline(std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    pImpl->deadline = deadline;
+}
+
+void PooledSession::clear_limits() {
+    std::lock_guard<std::mutex> lock(pImpl->mutex);
+    pImpl->cancel_token = CancelToken();
+    pImpl->deadline = std::chrono::steady_clock::time_point::max();
+}
+
+void PooledSession::clear() {
+    Impl * impl = pImpl.get();
+    impl->start<void>([impl](const call_done & done) {
+        impl->clear(done);
+    }, nullptr).get();
+}
@@ -123,8 +123,102 @@ struct llama_sampler * llama_sampler_init_select(
     return llama_sampler_init(&token_filter_i, ctx);
 }
 
+static std::vector<llama_token> tokenize_text(const llama_vocab * vocab, const std::string & text) {
+    std::vector<llama_token> tokens(text.size() + 2);
+    int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+    }
+    tokens.resize(n > 0 ? n : 0);
+    return tokens;
+}
+
+CompiledOptions::CompiledOptions(const struct llama_vocab * vocab, const std::vector<std::string> & options) {
+    std::shared_ptr<Data> compiled(new Data());
+    compiled->vocab = vocab;
+    compiled->options = options;
+    compiled->max_length = 0;
+
+    for (const auto & option : options) {
+        compiled->option_tokens.push_back(tokenize_text(vocab, option));
+        compiled->max_length = std::max(compiled->max_length, compiled->option_tokens.back().size());
+    }
+
+    data = compiled;
+}
+
+CompiledStops::CompiledStops(const struct llama_vocab * vocab, const std::vector<std::string> & stop_sequences) {
+    std::shared_ptr<Data> compiled(new Data());
+    compiled->vocab = vocab;
+    compiled->sequences = stop_sequences;
+    compiled->max_partial_length = 0;
+
+    for (const auto & seq : stop_sequences) {
+        for (llama_token token : tokenize_text(vocab, seq)) {
+            compiled->stop_tokens.insert(token);
+        }
+
+        // Only sequences ending with '>' get partial-tag completion, e.g. "</think", "</thin", ...
+        if (seq.length() <= 1 || seq.back() != '>') {
+            continue;
+        }
+
+        for (size_t partial_len = seq.length() - 1; partial_len >= 2; partial_len--) {
+            Partial partial;
+            partial.text = seq.substr(0, partial_len);
+
+            // Allow any token that starts the remaining sequence
+            std::string remaining = seq.substr(partial_len);
+            for (size_t i = 1; i <= remaining.length(); i++) {
+                std::vector<llama_token> tokens = tokenize_text(vocab, remaining.substr(0, i));
+                if (!tokens.empty()) {
+                    partial.allowed_tokens.insert(tokens[0]);
+                }
+            }
+
+            if (!partial.allowed_tokens.empty()) {
+                compiled->max_partial_length = std::max(compiled->max_partial_length, partial_len);
+                compiled->partials.push_back(partial);
+            }
+        }
+    }
+
+    data = compiled;
+}
+
+CompiledPattern::CompiledPattern(
+    const struct llama_vocab * vocab,
+    PatternType pattern,
+    const std::string & regex_pattern,
+    const std::vector<std::string> & stop_sequences
+) {
+    std::shared_ptr<Data> compiled(new Data());
+    compiled->vocab = vocab;
+    compiled->pattern = pattern;
+    compiled->regex_pattern = regex_pattern;
+    compiled->regex_valid = false;
+
+    if (pattern == PATTERN_REGEX && !regex_pattern.empty()) {
+        try {
+            compiled->regex = std::regex(regex_pattern);
+            compiled->regex_valid = true;
+        } catch (...) {
+            compiled->regex_valid = false;
+        }
+    }
+
+    for (const auto & seq : stop_sequences) {
+        for (llama_token token : tokenize_text(vocab, seq)) {
+            compiled->stop_tokens.insert(token);
+        }
+    }
+
+    data = compiled;
+}
+
 struct llama_sampler_prefix_select {
-    std::vector<std::vector<llama_token>> option_tokens;
+    std::shared_ptr<const CompiledOptions::Data> options;
     std::vector<bool> active_options;
     size_t position;
 };
@@ -135,13 +229,14 @@ static const char * prefix_select_name(const struct llama_sampler * smpl) {
 
 static void prefix_select_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_prefix_select *) smpl->ctx;
+    const auto & option_tokens = ctx->options->option_tokens;
 
     std::unordered_set<llama_token> allowed_tokens;
 
-    for (size_t i = 0; i < ctx->option_tokens.size(); i++) {
+    for (size_t i = 0; i < option_tokens.size(); i++) {
         if (!ctx->active_options[i]) continue;
 
-        const auto & tokens = ctx->option_tokens[i];
+        const auto & tokens = option_tokens[i];
         if (ctx->position < tokens.size()) {
             allowed_tokens.insert(tokens[ctx->position]);
         }
@@ -167,11 +262,12 @@ static void prefix_select_apply(struct llama_sampler * smpl, llama_token_data_ar
 
 static void prefix_select_accept(struct llama_sampler * smpl, llama_token token) {
     auto * ctx = (llama_sampler_prefix_select *) smpl->ctx;
+    const auto & option_tokens = ctx->options->option_tokens;
 
-    for (size_t i = 0; i < ctx->option_tokens.size(); i++) {
+    for (size_t i = 0; i < option_tokens.size(); i++) {
         if (!ctx->active_options[i]) continue;
 
-        const auto & tokens = ctx->option_tokens[i];
+        const auto & tokens = option_tokens[i];
         if (ctx->position >= tokens.size() || tokens[ctx->position] != token) {
             ctx->active_options[i] = false;
         }
@@ -189,7 +285,7 @@ static void prefix_select_reset(struct llama_sampler * smpl) {
 static struct llama_sampler * prefix_select_clone(const struct llama_sampler * smpl) {
     const auto * ctx = (const llama_sampler_prefix_select *) smpl->ctx;
     auto * result = new llama_sampler_prefix_select {
-        ctx->option_tokens,
+        ctx->options,
         ctx->active_options,
         ctx->position
     };
@@ -217,28 +313,23 @@ struct llama_sampler * llama_sampler_init_prefix_select(
     const struct llama_vocab * vocab,
     const std::vector<std::string> & options
 ) {
-    std::vector<std::vector<llama_token>> option_tokens;
-
-    for (const auto & option : options) {
-        std::vector<llama_token> tokens(option.size() + 2);
-        int n = llama_tokenize(vocab, option.c_str(), option.size(), tokens.data(), tokens.size(), false, false);
-        tokens.resize(n);
-        option_tokens.push_back(tokens);
-    }
+    return llama_sampler_init_prefix_select(CompiledOptions(vocab, options));
+}
 
+struct llama_sampler * llama_sampler_init_prefix_select(const CompiledOptions & options) {
     auto * ctx = new llama_sampler_prefix_select {
-        option_tokens,
-        std::vector<bool>(options.size(), true),
+        options.shared(),
+        std::vector<bool>(options.get().options.size(), true),
         0
     };
 
     return llama_sampler_init(&prefix_select_i, ctx);
 }
 
-static bool matches_pattern(const std::string & text, PatternType pattern, const std::string & regex_pattern) {
+static bool matches_pattern(const std::string & text, const CompiledPattern::Data & compiled) {
     if (text.empty()) return false;
 
-    switch (pattern) {
+    switch (compiled.pattern) {
         case PATTERN_NONE:
             return true;
 
@@ -297,13 +388,9 @@ static bool matches_pattern(const std::string & text, PatternType pattern, const
         }
 
         case PATTERN_REGEX:
-            if (!regex_pattern.empty()) {
-                try {
-                    std::regex re(regex_pattern);
-                    return std::regex_match(text, re);
-                } catch (...) {
-                    return false;
-                }
+            if (!compiled.regex_pattern.empty()) {
+                // Regex is compiled once in CompiledPattern; an invalid pattern matches nothing
+                return compiled.regex_valid && std::regex_match(text, compiled.regex);
             }
             return true;
 
@@ -313,11 +400,9 @@ static bool matches_pattern(const std::string & text, PatternType pattern, const
 }
 
 struct llama_sampler_pattern {
-    const llama_vocab * vocab;
-    PatternType pattern;
-    std::string regex_pattern;
+    std::shared_ptr<const CompiledPattern::Data> compiled;
     std::string accumulated;
-    std::unordered_set<llama_token> stop_tokens;
+    std::string scratch;
 };
 
 static const char * pattern_name(const struct llama_sampler * smpl) {
@@ -326,12 +411,13 @@ static const char * pattern_name(const struct llama_sampler * smpl) {
 
 static void pattern_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_pattern *) smpl->ctx;
+    const auto & compiled = *ctx->compiled;
 
     size_t write_idx = 0;
     for (size_t i = 0; i < cur_p->size; i++) {
         llama_token token = cur_p->data[i].id;
 
-        if (ctx->stop_tokens.find(token) != ctx->stop_tokens.end()) {
+        if (compiled.stop_tokens.find(token) != compiled.stop_tokens.end()) {
             if (write_idx != i) {
                 cur_p->data[write_idx] = cur_p->data[i];
             }
@@ -340,12 +426,12 @@ static void pattern_apply(struct llama_sampler * smpl, llama_token_data_array *
         }
 
         char buf[256];
-        int n = llama_token_to_piece(ctx->vocab, token, buf, sizeof(buf), 0, false);
+        int n = llama_token_to_piece(compiled.vocab, token, buf, sizeof(buf), 0, false);
         if (n > 0) {
-            std::string token_text(buf, n);
-            std::string test_text = ctx->accumulated + token_text;
+            ctx->scratch.assign(ctx->accumulated);
+            ctx->scratch.append(buf, n);
 
-            if (matches_pattern(test_text, ctx->pattern, ctx->regex_pattern)) {
+            if (matches_pattern(ctx->scratch, compiled)) {
                 if (write_idx != i) {
                     cur_p->data[write_idx] = cur_p->data[i];
                 }
@@ -362,9 +448,9 @@ static void pattern_accept(struct llama_sampler * smpl, llama_token token) {
     auto * ctx = (llama_sampler_pattern *) smpl->ctx;
 
     char buf[256];
-    int n = llama_token_to_piece(ctx->vocab, token, buf, sizeof(buf), 0, false);
+    int n = llama_token_to_piece(ctx->compiled->vocab, token, buf, sizeof(buf), 0, false);
     if (n > 0) {
-        ctx->accumulated += std::string(buf, n);
+        ctx->accumulated.append(buf, n);
     }
 }
 
@@ -376,11 +462,9 @@ static void pattern_reset(struct llama_sampler * smpl) {
 static struct llama_sampler * pattern_clone(const struct llama_sampler * smpl) {
     const auto * ctx = (const llama_sampler_pattern *) smpl->ctx;
     auto * result = new llama_sampler_pattern {
-        ctx->vocab,
-        ctx->pattern,
-        ctx->regex_pattern,
+        ctx->compiled,
         ctx->accumulated,
-        ctx->stop_tokens
+        ""
     };
 
     return llama_sampler_init(
@@ -408,24 +492,14 @@ struct llama_sampler * llama_sampler_init_pattern(
     const std::string & regex_pattern,
     const std::vector<std::string> & stop_sequences
 ) {
-    std::unordered_set<llama_token> stop_tokens;
-
-    for (const auto & seq : stop_sequences) {
-        std::vector<llama_token> tokens(seq.size() + 2);
-        int n = llama_tokenize(vocab, seq.c_str(), seq.size(), tokens.data(), tokens.size(), false, false);
-        tokens.resize(n);
-
-        for (llama_token token : tokens) {
-            stop_tokens.insert(token);
-        }
-    }
+    return llama_sampler_init_pattern(CompiledPattern(vocab, pattern, regex_pattern, stop_sequences));
+}
 
+struct llama_sampler * llama_sampler_init_pattern(const CompiledPattern & pattern) {
     auto * ctx = new llama_sampler_pattern {
-        vocab,
-        pattern,
-        regex_pattern,
+        pattern.shared(),
         "",
-        stop_tokens
+        ""
     };
 
     return llama_sampler_init(&pattern_i, ctx);
@@ -433,8 +507,7 @@ struct llama_sampler * llama_sampler_init_pattern(
 
 // Stop sequence sampler - prevents malformed tag generation
 struct llama_sampler_stop_sequence {
-    const llama_vocab * vocab;
-    std::vector<std::string> stop_sequences;
+    std::shared_ptr<const CompiledStops::Data> stops;
     std::string accumulated;
 };
 
@@ -442,57 +515,35 @@ static const char * stop_sequence_name(const struct llama_sampler * smpl) {
     return "stop-sequence";
 }
 
+static bool ends_with(const std::string & text, const std::string & suffix) {
+    return text.length() >= suffix.length() &&
+           text.compare(text.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
 static void stop_sequence_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_stop_sequence *) smpl->ctx;
 
-    // Check if accumulated text ends with a partial stop sequence
-    for (const auto & seq : ctx->stop_sequences) {
-        // For sequences ending with '>', check all partial matches
-        if (seq.length() > 1 && seq.back() == '>') {
-            // Check progressively shorter partial matches, e.g., "</think", "</thin", "</thi", etc.
-            for (size_t partial_len = seq.length() - 1; partial_len >= 2; partial_len--) {
-                std::string partial = seq.substr(0, partial_len);
-
-                if (ctx->accumulated.length() >= partial.length()) {
-                    std::string acc_end = ctx->accumulated.substr(ctx->accumulated.length() - partial.length());
-
-                    if (acc_end == partial) {
-                        // Found partial match! Only allow tokens that continue toward completion
-                        std::string remaining = seq.substr(partial_len);
-
-                        // Build set of allowed tokens
-                        std::unordered_set<llama_token> allowed_tokens;
-
-                        // Allow any token that starts the remaining sequence
-                        for (size_t i = 1; i <= remaining.length(); i++) {
-                            std::string prefix = remaining.substr(0, i);
-                            std::vector<llama_token> tokens(prefix.size() + 2);
-                            int n = llama_tokenize(ctx->vocab, prefix.c_str(), prefix.size(),
-                                                   tokens.data(), tokens.size(), false, false);
-                            if (n > 0) {
-                                allowed_tokens.insert(tokens[0]);
-                            }
-                        }
-
-                        if (!allowed_tokens.empty()) {
-                            // Filter to only allowed tokens
-                            size_t write_idx = 0;
-                            for (size_t i = 0; i < cur_p->size; i++) {
-                                if (allowed_tokens.find(cur_p->data[i].id) != allowed_tokens.end()) {
-                                    if (write_idx != i) {
-                                        cur_p->data[write_idx] = cur_p->data[i];
-                                    }
-                                    write_idx++;
-                                }
-                            }
-                            cur_p->size = write_idx;
-                            cur_p->sorted = false;
-                            return;
-                        }
-                    }
+    // Check if accumulated text ends with a partial stop sequence, longest partials first
+    for (const auto & partial : ctx->stops->partials) {
+        if (!ends_with(ctx->accumulated, partial.text)) {
+            continue;
+        }
+
+        // Found partial match! Only allow tokens that continue toward completion
+        const auto & allowed_tokens = partial.allowed_tokens;
+
+        size_t write_idx = 0;
+        for (size_t i = 0; i < cur_p->size; i++) {
+            if (allowed_tokens.find(cur_p->data[i].id) != allowed_tokens.end()) {
+                if (write_idx != i) {
+                    cur_p->data[write_idx] = cur_p->data[i];
                 }
+                write_idx++;
             }
         }
+        cur_p->size = write_idx;
+        cur_p->sorted = false;
+        return;
     }
 }
 
@@ -500,9 +551,15 @@ static void stop_sequence_accept(struct llama_sampler * smpl, llama_token token)
     auto * ctx = (llama_sampler_stop_sequence *) smpl->ctx;
 
     char buf[256];
-    int n = llama_token_to_piece(ctx->vocab, token, buf, sizeof(buf), 0, false);
+    int n = llama_token_to_piece(ctx->stops->vocab, token, buf, sizeof(buf), 0, false);
     if (n > 0) {
-        ctx->accumulated += std::string(buf, n);
+        ctx->accumulated.append(buf, n);
+
+        // Only the tail can still form a partial match
+        size_t keep = ctx->stops->max_partial_length;
+        if (ctx->accumulated.length() > keep) {
+            ctx->accumulated.erase(0, ctx->accumulated.length() - keep);
+        }
     }
 }
 
@@ -514,8 +571,7 @@ static void stop_sequence_reset(struct llama_sampler * smpl) {
 static struct llama_sampler * stop_sequence_clone(const struct llama_sampler * smpl) {
     const auto * ctx = (const llama_sampler_stop_sequence *) smpl->ctx;
     auto * result = new llama_sampler_stop_sequence {
-        ctx->vocab,
-        ctx->stop_sequences,
+        ctx->stops,
         ctx->accumulated
     };
 
@@ -542,10 +598,140 @@ struct llama_sampler * llama_sampler_init_stop_sequence(
     const struct llama_vocab * vocab,
     const std::vector<std::string> & stop_sequences
 ) {
+    return llama_sampler_init_stop_sequence(CompiledStops(vocab, stop_sequences));
+}
+
+struct llama_sampler * llama_sampler_init_stop_sequence(const CompiledStops & stops) {
     auto * ctx = new llama_sampler_stop_sequence();
-    ctx->vocab = vocab;
-    ctx->stop_sequences = stop_sequences;
+    ctx->stops = stops.shared();
     ctx->accumulated = "";
 
     return llama_sampler_init(&stop_sequence_i, ctx);
 }
+
+// Forced token detection for jump-forward decoding
+
+enum forced_state {
+    FORCED_UNKNOWN,
+    FORCED_NONE,
+    FORCED_TOKEN
+};
+
+static bool is_constraint_sampler(const struct llama_sampler * smpl) {
+    return smpl->iface == &token_filter_i ||
+           smpl->iface == &prefix_select_i ||
+           smpl->iface == &pattern_i ||
+           smpl->iface == &stop_sequence_i;
+}
+
+// Samplers that keep a single remaining candidate as the selected token
+static bool is_passthrough_sampler(const struct llama_sampler * smpl) {
+    const char * name = llama_sampler_name(smpl);
+    return std::strcmp(name, "temp") == 0 ||
+           std::strcmp(name, "dist") == 0 ||
+           std::strcmp(name, "greedy") == 0;
+}
+
+static forced_state sampler_forced_token(const struct llama_sampler * smpl, llama_token * token) {
+    if (smpl->iface == &token_filter_i) {
+        const auto * ctx = (const llama_sampler_token_filter *) smpl->ctx;
+        if (ctx->is_allowlist && ctx->token_set.size() == 1) {
+            *token = *ctx->token_set.begin();
+            return FORCED_TOKEN;
+        }
+        return FORCED_NONE;
+    }
+
+    if (smpl->iface == &prefix_select_i) {
+        const auto * ctx = (const llama_sampler_prefix_select *) smpl->ctx;
+        const auto & option_tokens = ctx->options->option_tokens;
+
+        bool found = false;
+        llama_token forced = 0;
+        for (size_t i = 0; i < option_tokens.size(); i++) {
+            if (!ctx->active_options[i] || ctx->position >= option_tokens[i].size()) continue;
+
+            llama_token next = option_tokens[i][ctx->position];
+            if (found && next != forced) {
+                return FORCED_NONE;
+            }
+            forced = next;
+            found = true;
+        }
+
+        if (!found) {
+            return FORCED_NONE;
+        }
+        *token = forced;
+        return FORCED_TOKEN;
+    }
+
+    if (smpl->iface == &stop_sequence_i) {
+        const auto * ctx = (const llama_sampler_stop_sequence *) smpl->ctx;
+
+        // Mirrors stop_sequence_apply: the first matching partial decides the filter
+        for (const auto & partial : ctx->stops->partials) {
+            if (!ends_with(ctx->accumulated, partial.text)) {
+                continue;
+            }
+            if (partial.allowed_tokens.size() != 1) {
+                return FORCED_NONE;
+            }
+            *token = *partial.allowed_tokens.begin();
+            return FORCED_TOKEN;
+        }
+        return FORCED_NONE;
+    }
+
+    if (smpl->iface == &pattern_i || is_passthrough_sampler(smpl)) {
+        return FORCED_NONE;
+    }
+
+    return FORCED_UNKNOWN;
+}
+
+bool llama_sampler_get_forced_token(const struct llama_sampler * smpl, llama_token * token) {
+    std::vector<struct llama_sampler *> members;
+    if (std::strcmp(llama_sampler_name(smpl), "chain") == 0) {
+        for (int i = 0; i < llama_sampler_chain_n(smpl); i++) {
+            members.push_back(llama_sampler_chain_get(smpl, i));
+        }
+    } else {
+        members.push_back(const_cast<struct llama_sampler *>(smpl));
+    }
+
+    bool found = false;
+    llama_token forced = 0;
+    for (auto * member : members) {
+        llama_token member_token;
+        forced_state state = sampler_forced_token(member, &member_token);
+
+        // Unknown samplers may reshape the distribution, so never skip them
+        if (state == FORCED_UNKNOWN) {
+            return false;
+        }
+        if (state == FORCED_TOKEN && !found) {
+            forced = member_token;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        return false;
+    }
+
+    // Every other constraint must keep the forced token as well
+    for (auto * member : members) {
+        if (!is_constraint_sampler(member)) continue;
+
+        llama_token_data candidate = { forced, 0.0f, 0.0f };
+        llama_token_data_array cur = { &candidate, 1, -1, false };
+        llama_sampler_apply(member, &cur);
+        if (cur.size != 1) {
+            return false;
+        }
+    }
+
+    *token = forced;
+    return true;
+}